@@ -22,6 +22,7 @@
 #include "proof.h"
 #include "pocklington.h"
 #include "morrison.h"
+#include "small.h"
 #include "order.h"
 #include "batch.h"
 #include "abc_parser.h"
@@ -52,6 +53,9 @@ int batch_main(int argc, char *argv[])
         .value_number("-t", ' ', options.thread_count, 1, 256)
         .value_number("-spin", ' ', options.spin_threads, 0, 256)
         .value_enum("-cpu", ' ', options.instructions, Enum<std::string>().add("SSE2", "SSE2").add("AVX", "AVX").add("FMA3", "FMA3").add("AVX512F", "AVX512F"))
+        .value_number("-mem", ' ', MultipointExp::MEMORY_LIMIT, 1, INT_MAX)
+        .value_string("-dac", ' ', DACCache::FILENAME)
+        .value_number("-small", ' ', SmallRun::MAX_BITLEN, 0, INT_MAX)
         .value_number("-fft", '+', options.next_fft_count, 0, 5)
         .group("-fft")
             .value_number("+", 0, options.next_fft_count, 0, 5)
@@ -75,7 +79,7 @@ int batch_main(int argc, char *argv[])
             .value_number("a", ' ', options.FermatBase, 2, INT_MAX)
             .end()
             .on_check(options.ForceFermat, true)
-        .value_code("-order", ' ', [&](const char* param) { options.OrderA.reset(new InputNum()); return options.OrderA->parse(param, false) && options.OrderA->value() > 1; })
+        .value_code("-order", ' ', [&](const char* param) { return options.parse_order(param); })
         .group("-divides")
             .exclusive()
                 .ex_case()
@@ -93,6 +97,12 @@ int batch_main(int argc, char *argv[])
                     .end()
                 .end()
             .end()
+        .group("-prpfirst")
+            .exclusive()
+                .ex_case().check("on", options.PRPFirst, true).end()
+                .ex_case().check("off", options.PRPFirst, false).end()
+                .end()
+            .end()
         .group("-factors")
             .list("list", ' ', ',', false)
                 .value_code([&](const char* param) {
@@ -179,10 +189,14 @@ int batch_main(int argc, char *argv[])
         printf("\t-fft+1\n");
         printf("\t-fft [+<inc>] [safety <margin>] [generic] [info]\n");
         printf("\t-cpu {SSE2 | AVX | FMA3 | AVX512F}\n");
+        printf("\t-mem <MB>\n");
+        printf("\t-dac <filename>\n");
+        printf("\t-small <bits>\n");
         printf("\t-trial\n");
         printf("\t-fermat [a <a>]\n");
         printf("\t-order {<a> | \"K*B^N+C\"}\n");
         printf("\t-divides {f | gf | xgf} [limit 12]\n");
+        printf("\t-prpfirst {on | off}\n");
         printf("\t-factors [list <factor>,...] [file <filename>] [all]\n");
         printf("\t-check [{near | always| never}] [strong [disable] [count <count>]]\n");
         printf("\t-stop [on error] [on prime] [on primek] [on composites <count>]\n");
@@ -193,6 +207,10 @@ int batch_main(int argc, char *argv[])
         return PRST_EXIT_NORMAL;
     }
 
+    // Most candidates of a batch are composite.
+    if (!options.PRPFirst)
+        options.PRPFirst = true;
+
     Logging logging_batch(log_batch_level);
     if (!log_file.empty())
         logging_batch.file_log(log_file);
@@ -214,8 +232,8 @@ int batch_main(int argc, char *argv[])
     size_t total = source ? source->size() : 0;
 
     std::string filename_suffix;
-    if (options.OrderA && !options.OrderA->empty() && options.OrderA->value() > 1)
-        filename_suffix = ".ord" + std::to_string(options.OrderA->fingerprint());
+    if (!options.OrderA.empty())
+        filename_suffix = ".ord" + std::to_string(options.order_fingerprint());
     else if (!options.Divides.empty())
         filename_suffix = ".div";
     else if (options.FermatBase)
@@ -233,10 +251,84 @@ int batch_main(int argc, char *argv[])
     // Per-k tracking: k_value -> whether a prime has been found for this k
     std::map<std::string, bool> k_prime_found;
 
+    // Small Fermat and Proth candidates are collected into lanes and tested on all threads at once.
+    // Their results are kept in the lanes and reported in batch order through one logger
+    // when the lanes are full or a different test comes.
+    struct Lane
+    {
+        int cur;
+        std::string k_value;
+        InputNum input;
+        std::unique_ptr<Run> run;
+    };
+    std::vector<std::unique_ptr<Lane>> lanes;
+    Logging logging_lanes(options.information_only && log_level > Logging::LEVEL_INFO ? Logging::LEVEL_INFO : log_level);
+    if (!log_file.empty())
+        logging_lanes.file_log(log_file);
+    int lane_count = 0;
+    double lane_time = 0;
+
     bool success = false;
-    for (; batch_name == "stdin" || cur < (int)total; cur++)
+    auto stop_at = [&](int index)
     {
+        if (!(success && stop_prime) && !(stop_composites > 0 && composites >= stop_composites))
+            return false;
+        if (!success)
+            logging_batch.info("Stopping: %d consecutive composites reached.\n", composites);
+        cur = index;
         logging_batch.report_param("cur", cur);
+        Task::abort();
+        return true;
+    };
+    // Tests the lanes and reports them, next is the candidate after them.
+    auto run_lanes = [&](int next)
+    {
+        if (lanes.empty())
+            return false;
+        // Each lane owns its Giants, see parallel_for().
+        double time = logging_batch.progress().time_total();
+        parallel_for((int)lanes.size(), options.thread_count, [&](int i) { dynamic_cast<SmallRun*>(lanes[i]->run.get())->calc(); });
+        lane_time += logging_batch.progress().time_total() - time;
+
+        bool stop = false;
+        for (auto it = lanes.begin(); it != lanes.end(); it++)
+        {
+            Lane& lane = **it;
+            if (stop_at(lane.cur))
+            {
+                stop = true;
+                break;
+            }
+
+            SmallRun* small = dynamic_cast<SmallRun*>(lane.run.get());
+            small->report(logging_lanes);
+            success = small->success();
+            lane_count++;
+
+            if (success)
+            {
+                primes++;
+                logging_batch.report_param("primes", primes);
+                composites = 0;
+                logging_batch.report_param("composites", composites);
+                if (!lane.k_value.empty())
+                    k_prime_found[lane.k_value] = true;
+            }
+            else
+            {
+                composites++;
+                logging_batch.report_param("composites", composites);
+            }
+        }
+        lanes.clear();
+        if (!stop && next < (int)total && stop_at(next))
+            stop = true;
+        return stop;
+    };
+
+    for (; batch_name == "stdin" || cur < (int)total; cur++)
+    {
+        logging_batch.report_param("cur", lanes.empty() ? cur : lanes.front()->cur);
         logging_batch.progress().update(total > 0 ? cur/(double)total : 0, 0);
         logging_batch.progress_save();
         if (success && stop_prime)
@@ -272,7 +364,14 @@ int batch_main(int argc, char *argv[])
             k_value = std::move(cand.k_value);
         }
 
-        // Per-k skip: if stop_k_prime is set and we already found a prime for this k
+        // Per-k skip: if stop_k_prime is set and we already found a prime for this k.
+        // A pending lane of the same k may be that prime, so the lanes are reported first.
+        bool pending = false;
+        if (stop_k_prime && !k_value.empty())
+            for (auto& lane : lanes)
+                pending |= lane->k_value == k_value;
+        if (pending && run_lanes(cur))
+            break;
         if (stop_k_prime && !k_value.empty() && k_prime_found.count(k_value) && k_prime_found[k_value])
         {
             logging_batch.info("%d of %d: %s, skipping (prime already found for k=%s).\n",
@@ -280,7 +379,8 @@ int batch_main(int argc, char *argv[])
             continue;
         }
 
-        InputNum input;
+        std::unique_ptr<Lane> lane(new Lane());
+        InputNum& input = lane->input;
         InputNum::ParseResult res = input.parse(expression);
         if (!res)
         {
@@ -312,6 +412,8 @@ int batch_main(int argc, char *argv[])
 
         if (input.bitlen() <= 40)
         {
+            if (run_lanes(cur))
+                break;
             if (batch_name != "stdin")
                 logging_batch.info("%s, Trial division test.\n", run_name.data());
             logging.info("Trial division test of %s.\n", input.display_text().data());
@@ -330,6 +432,8 @@ int batch_main(int argc, char *argv[])
             logging.progress().update(1, 0);
             if (!factors.empty())
             {
+                if (run_lanes(cur))
+                    break;
                 if (batch_name != "stdin")
                     logging_batch.info("%s, trial division found factor %d.\n", run_name.data(), factors[0]);
                 Giant factor;
@@ -353,31 +457,62 @@ int batch_main(int argc, char *argv[])
         if (run->finished())
             continue;
 
-        fingerprint = run->fingerprint();
-        File file_checkpoint(filename_prefix + filename_suffix + ".ckpt", fingerprint);
-        File file_recoverypoint(filename_prefix + filename_suffix + ".rcpt", fingerprint);
-
-        GWState gwstate;
-        options.configure(gwstate);
-        logging.progress().configure(gwstate);
-        input.setup(gwstate);
-        logging.info("Using %s.\n", gwstate.fft_description.data());
+        SmallRun* small = dynamic_cast<SmallRun*>(run.get());
+        if (small != nullptr && small->lane() && batch_name != "stdin")
+        {
+            // Resumes test pending lanes again, their progress is not saved.
+            file_progress.clear();
+            lane->cur = cur;
+            lane->k_value = std::move(k_value);
+            lane->run = std::move(run);
+            lanes.push_back(std::move(lane));
+            if (lanes.size() >= 16*options.thread_count && run_lanes(cur + 1))
+                break;
+            continue;
+        }
+        if (run_lanes(cur))
+            break;
 
         success = false;
         bool failed = false;
-        try
+        if (small != nullptr)
         {
-            run->run(gwstate, file_checkpoint, file_recoverypoint, logging);
-            success = run->success();
+            small->run(logging);
+            success = small->success();
             file_progress.clear();
         }
-        catch (const TaskAbortException&)
+        else
         {
-            if (!options.information_only)
+            fingerprint = run->fingerprint();
+            File file_checkpoint(filename_prefix + filename_suffix + ".ckpt", fingerprint);
+            File file_recoverypoint(filename_prefix + filename_suffix + ".rcpt", fingerprint);
+
+            GWState gwstate;
+            options.configure(gwstate, input);
+            logging.progress().configure(gwstate);
+            input.setup(gwstate);
+            logging.info("Using %s.\n", gwstate.fft_description.data());
+
+            try
+            {
+                run->run(gwstate, file_checkpoint, file_recoverypoint, logging);
+                success = run->success();
+                file_progress.clear();
+            }
+            catch (const CheckpointFFTException&)
+            {
+                logging.error("The checkpoint was written with another FFT, run -migrate with the options the test was started with.\n");
                 failed = true;
-        }
+            }
+            catch (const TaskAbortException&)
+            {
+                if (!options.information_only)
+                    failed = true;
+            }
 
-        gwstate.done();
+            gwstate.done();
+            DACCache::save();
+        }
 
         if (success)
         {
@@ -399,6 +534,8 @@ int batch_main(int argc, char *argv[])
             break;
     }
 
+    if (!Task::abort_flag())
+        run_lanes(cur);
     logging_batch.progress().update(total > 0 ? cur/(double)total : 0, 0);
     if (Task::abort_flag() && batch_name != "stdin")
     {
@@ -409,6 +546,8 @@ int batch_main(int argc, char *argv[])
     {
         batch_progress.clear();
         logging_batch.info("Batch of %d, primes: %d, time: %.1f s.\n", cur, primes, logging_batch.progress().time_total());
+        if (lane_count > 0)
+            logging_batch.info("%d candidates tested in lanes, %.1f candidates/s.\n", lane_count, lane_time > 0 ? lane_count/lane_time : 0.0);
     }
 
     return PRST_EXIT_NORMAL;
@@ -329,7 +329,7 @@ int boinc_main(int argc, char *argv[])
     File file_recoverypoint(filename_prefix + filename_suffix + ".rcpt", fingerprint);
 
     GWState gwstate;
-    options.configure(gwstate);
+    options.configure(gwstate, input);
     logging.progress().configure(gwstate);
     input.setup(gwstate);
     logging.info("Using %s.\n", gwstate.fft_description.data());
@@ -1,6 +1,10 @@
 
 #include <cmath>
 #include <iostream>
+#include <chrono>
+#include <climits>
+#include <thread>
+#include <atomic>
 #include <string.h>
 
 #include "gwnum.h"
@@ -10,6 +14,124 @@
 
 using namespace arithmetic;
 
+int MultipointExp::MEMORY_LIMIT = 0;
+
+void GWNumPool::alloc(GWArithmetic& gw, std::unique_ptr<GWNum>& X)
+{
+    if (_free.empty())
+    {
+        X.reset(new GWNum(gw));
+        _allocated++;
+    }
+    else
+    {
+        X.reset(new GWNum(std::move(_free.back())));
+        _free.pop_back();
+        _reused++;
+    }
+    if (++_used > _peak)
+        _peak = _used;
+}
+
+void GWNumPool::alloc(GWArithmetic& gw, std::vector<GWNum>& U)
+{
+    if (_free.empty())
+    {
+        U.emplace_back(gw);
+        _allocated++;
+    }
+    else
+    {
+        U.push_back(std::move(_free.back()));
+        _free.pop_back();
+        _reused++;
+    }
+    if (++_used > _peak)
+        _peak = _used;
+}
+
+void GWNumPool::free(std::unique_ptr<GWNum>& X)
+{
+    _free.push_back(std::move(*X));
+    X.reset();
+    _used--;
+}
+
+void GWNumPool::free(std::vector<GWNum>& U)
+{
+    for (auto& X : U)
+        _free.push_back(std::move(X));
+    _used -= (int)U.size();
+    U.clear();
+}
+
+void GWNumPool::report(Logging& logging)
+{
+    logging.debug("GWNum pool: %d allocated, %d reused, peak %d in use, %d free.\n", _allocated, _reused, _peak, (int)_free.size());
+}
+
+PortableGWNum& PortableGWNum::operator = (const GWNum& X)
+{
+    _serialized = X;
+    _fft = fft_fingerprint(X.arithmetic().state());
+    _canonical = false;
+    return *this;
+}
+
+void PortableGWNum::to_GWNum(GWNum& X)
+{
+    // Values written before the fingerprint are assumed to match the FFT.
+    if (_fft == 0 || _fft == fft_fingerprint(X.arithmetic().state()))
+        X = _serialized;
+    else if (_canonical)
+        X = _value;
+    else
+        throw CheckpointFFTException();
+}
+
+bool PortableGWNum::migrate(GWArithmetic& gw)
+{
+    int fft = fft_fingerprint(gw.state());
+    if (_fft != 0 && _fft != fft && !_canonical)
+        return false;
+    GWNum X(gw);
+    to_GWNum(X);
+    // Not reduced mod N: X and D of a strong check have to stay in step mod k*b^n+c.
+    _value = X;
+    _serialized = X;
+    _fft = fft;
+    _canonical = true;
+    return true;
+}
+
+bool PortableGWNum::read_values(Reader& reader, std::initializer_list<PortableGWNum*> values)
+{
+    bool first = true;
+    for (auto value : values)
+    {
+        int fft, canonical;
+        if (!reader.read(fft))
+            return first;
+        first = false;
+        if (!reader.read(canonical) || (canonical != 0 && !reader.read(value->_value)))
+            return false;
+        value->_fft = fft;
+        value->_canonical = canonical != 0;
+    }
+    return true;
+}
+
+void PortableGWNum::write_values(Writer& writer, std::initializer_list<PortableGWNum*> values)
+{
+    for (auto value : values)
+    {
+        writer.write(value->_fft);
+        writer.write(value->_canonical ? 1 : 0);
+        if (value->_canonical)
+            writer.write(value->_value);
+    }
+}
+
 BaseExp::State* BaseExp::State::read_file(File* file)
 {
     if (file == nullptr)
@@ -69,7 +191,7 @@ BaseExp::State* BaseExp::State::cast(bool value, std::unique_ptr<TaskState>& sta
 void CarefulExp::init(InputNum* input, GWState* gwstate, Logging* logging)
 {
     GWASSERT(!smooth());
-    GWASSERT(_x0 != 0 || !_X0.empty());
+    GWASSERT(_x0 != 0 || has_X0());
     GWASSERT(_x0 <= (uint32_t)gwstate->maxmulbyconst);
     BaseExp::init(input, gwstate, nullptr, nullptr, logging, _exp.bitlen() - 1 + (!_tail.empty() ? 1 : 0));
     _state_update_period = MULS_PER_STATE_UPDATE*2/3;
@@ -87,16 +209,20 @@ void CarefulExp::execute()
     int i, len;
 
     len = _exp.bitlen() - 1;
-    GWNum X0(gw());
-    if (!_X0.empty())
-        X0 = _X0;
+    std::unique_ptr<GWNum> pX0;
+    std::unique_ptr<GWNum> pX;
+    pool_alloc(pX0);
+    pool_alloc(pX);
+    GWNum& X0 = *pX0;
+    GWNum& X = *pX;
+    if (has_X0())
+        set_X0(X0);
     if (_x0 > 0)
         gw().setmulbyconst(_x0);
-    GWNum X(gw());
     if (state() == nullptr)
     {
         i = 0;
-        if (!_X0.empty())
+        if (has_X0())
             X = X0;
         if (_x0 > 0)
             X = _x0;
@@ -106,12 +232,17 @@ void CarefulExp::execute()
         i = state()->iteration();
         state()->to_GWNum(X);
     }
+    if (!_carefully && i < 30)
+        gwset_carefully_count(gw().gwdata(), 30 - i);
     for (; i < len; i++, commit_execute(i, X))
     {
-        gw().carefully().square(X, X, (_x0 > 0 && _exp.bit(len - i - 1) ? GWMUL_MULBYCONST : 0));
-        if (!_X0.empty() && _exp.bit(len - i - 1))
-            gw().carefully().mul(X, X0, X, 0);
+        GWArithmetic& gwa = _carefully || i >= len - 30 ? gw().carefully() : gw();
+        gwa.square(X, X, (_x0 > 0 && _exp.bit(len - i - 1) ? GWMUL_MULBYCONST : 0));
+        if (has_X0() && _exp.bit(len - i - 1))
+            gwa.mul(X, X0, X, 0);
     }
+    if (!_carefully)
+        check();
     if (i < iterations())
     {
         GWNum T(gw());
@@ -120,14 +251,18 @@ void CarefulExp::execute()
         i++;
         commit_execute(i, X);
     }
+    if (_result_fft)
+        _result_X = std::move(pX);
+    pool_free(pX0);
+    pool_free(pX);
 
     done();
 }
 
 void MultipointExp::init(InputNum* input, GWState* gwstate, File* file, Logging* logging)
 {
-    GWASSERT(smooth() || _x0 != 0 || !_X0.empty());
-    GWASSERT(!smooth() || (_x0 == 0 && _X0.empty()));
+    GWASSERT(smooth() || _x0 != 0 || has_X0());
+    GWASSERT(!smooth() || (_x0 == 0 && !has_X0()));
     GWASSERT(_x0 <= (uint32_t)gwstate->maxmulbyconst);
     BaseExp::init(input, gwstate, file, nullptr, logging, _points.back().pos + (!_tail.empty() ? 1 : 0));
     _state_update_period = MULS_PER_STATE_UPDATE;
@@ -160,10 +295,12 @@ void MultipointExp::init_state(State* state)
 void MultipointExp::setup()
 {
     if (!_X)
-        _X.reset(new GWNum(gw()));
-    if (!smooth() && !_X0.empty() && _U.empty())
+        pool_alloc(_X);
+    if ((smooth() && b() != 2) || (!smooth() && has_X0()))
+        window_measure();
+    if (!smooth() && has_X0() && _U.empty())
     {
-        X() = _X0;
+        set_X0(X());
         gwset_carefully_count(gw().gwdata(), 30);
         slide_init(_exp.bitlen() - 1);
         std::vector<arithmetic::GWNum> U;
@@ -175,8 +312,8 @@ void MultipointExp::setup()
 
 void MultipointExp::release()
 {
-    _X.reset();
-    _U.clear();
+    pool_free(_X);
+    pool_free(_U);
 }
 
 void MultipointExp::execute()
@@ -186,9 +323,7 @@ void MultipointExp::execute()
 
     int i, next_point;
     int len;
-    Giant tmp;
     State* tmp_state;
-    int last_power = -1;
 
     len = _exp.bitlen() - 1;
     if (_x0 > 0)
@@ -196,8 +331,8 @@ void MultipointExp::execute()
     if (state() == nullptr && !smooth())
     {
         i = 0;
-        if (!_X0.empty())
-            X() = _X0;
+        if (has_X0())
+            set_X0(X());
         if (_x0 > 0)
             X() = _x0;
         tmp_state = new StateSerialized();
@@ -228,23 +363,17 @@ void MultipointExp::execute()
         }
         else if (smooth())
         {
-            if (last_power != _points[next_point].pos - i)
-            {
-                last_power = _points[next_point].pos - i;
-                tmp = b();
-                tmp.power(last_power);
-            }
-            sliding_window(tmp);
+            sliding_window(smooth_power(_points[next_point].pos - i));
             i = _points[next_point].pos;
         }
-        else if (!_X0.empty())
+        else if (has_X0())
         {
             slide(_exp, i, _points[next_point].pos, true);
             i = _points[next_point].pos;
         }
 
         check();
-        tmp_state = State::cast(_points[next_point].value, _tmp_state);
+        tmp_state = State::cast(_points[next_point].value && !(_result_fft && i == iterations()), _tmp_state);
         tmp_state->set(i, X());
         if (_on_point != nullptr)
         {
@@ -267,25 +396,107 @@ void MultipointExp::execute()
         i++;
         commit_execute(i, X());
     }
+    if (_result_fft)
+        _result_X = std::move(_X);
 
     done();
 }
 
-int MultipointExp::slide_init(int len)
+void MultipointExp::window_measure()
 {
+    // Cost of a multiplication by a pre-transformed table entry relative to a squaring, measured once per task and FFT.
+    char description[200];
+    gwfft_description(gw().gwdata(), description);
+    if (_mul_cost_fft != description)
+    {
+        int i, j;
+        int count = 50;
+        int rounds = 5;
+        GWNum T(gw());
+        GWNum S(gw());
+        T = 3;
+        for (i = 0; i < 10; i++)
+            gw().square(T, T, 0);
+        S = T;
+        // Round 0 warms up the caches and the pre-transformed S, the best of the other rounds is taken.
+        double time_square = 0;
+        double time_mul = 0;
+        for (j = 0; j <= rounds; j++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (i = 0; i < count; i++)
+                gw().square(T, T, GWMUL_STARTNEXTFFT);
+            auto middle = std::chrono::steady_clock::now();
+            for (i = 0; i < count; i++)
+                gw().mul(S, T, T, GWMUL_FFT_S1 | GWMUL_STARTNEXTFFT);
+            auto end = std::chrono::steady_clock::now();
+            if (j == 0)
+                continue;
+            double time = std::chrono::duration<double>(middle - start).count();
+            if (j == 1 || time < time_square)
+                time_square = time;
+            time = std::chrono::duration<double>(end - middle).count();
+            if (j == 1 || time < time_mul)
+                time_mul = time;
+        }
+        _mul_cost = time_square > 0 && time_mul > 0 ? time_mul/time_square : 1.0;
+        _mul_cost_fft = description;
+        _logging->debug("%s, mul/square time ratio %.3f.\n", description, _mul_cost);
+    }
+
+    _mem_size = -1;
+    if (MEMORY_LIMIT > 0)
+    {
+        double size = MEMORY_LIMIT*1048576.0/gwnum_size(gw().gwdata()) - 4;
+        _mem_size = size < 1 ? 1 : size > INT_MAX ? INT_MAX : (int)size;
+    }
+}
+
+void MultipointExp::window_estimate(int bitlen)
+{
+    // A fixed ratio, so the plans built on cost() are the same for a given input and options in every run.
+    _mul_cost = 1.0;
+    _mul_cost_fft.clear();
+
+    // An FFT word holds at least 16 bits of N for the lengths the window matters at.
+    _mem_size = -1;
+    if (MEMORY_LIMIT > 0)
+    {
+        double size = MEMORY_LIMIT*1048576.0/(bitlen/16.0*sizeof(double)) - 4;
+        _mem_size = size < 1 ? 1 : size > INT_MAX ? INT_MAX : (int)size;
+    }
+}
+
+int MultipointExp::window_size(double len, int min_W)
+{
+    int max_W = _W;
+    if (max_W == 0)
+        max_W = _mem_size != -1 ? -1 : 5;
     int W;
-    for (W = 1; (W < _W || _W == -1) && ((1 << (W + 1)) <= _max_size || _max_size == -1) && (1 << (W - 1)) + len*(1 + 1/(W + 1.0)) > (1 << (W - 0)) + len*(1 + 1/(W + 2.0)); W++);
+    for (W = min_W; (W < max_W || max_W == -1) && ((1 << (W + 1)) <= _max_size || _max_size == -1) && ((1 << W) <= _mem_size || _mem_size == -1) && (1 << (W - 1))*_mul_cost + len*(1 + _mul_cost/(W + 1.0)) > (1 << (W - 0))*_mul_cost + len*(1 + _mul_cost/(W + 2.0)); W++);
+    return W;
+}
+
+int MultipointExp::slide_init(int len)
+{
+    int W = window_size(len);
+    if (W != _last_W)
+    {
+        _last_W = W;
+        _logging->debug("sliding window W = %d.\n", W);
+        _logging->report_param("W", W);
+    }
 
     _U.reserve((size_t)1 << (W - 1));
     if (_U.size() <= 0)
-        _U.emplace_back(gw());
+        pool_alloc(_U);
     swap(_U[0], X());
     if (W > 1)
         gw().square(_U[0], X(), GWMUL_STARTNEXTFFT);
     for (int i = 1; i < (1 << (W - 1)); i++)
     {
         if (_U.size() <= i)
-            _U.emplace_back(gw());
+            pool_alloc(_U);
         gw().mul(X(), _U[i - 1], _U[i], GWMUL_FFT_S1 | GWMUL_FFT_S2 | GWMUL_STARTNEXTFFT);
     }
     return W;
@@ -328,26 +539,72 @@ void MultipointExp::slide(const arithmetic::Giant& exp, int start, int end, bool
     }
 }
 
+Giant& MultipointExp::smooth_power(int power)
+{
+    if (_smooth_power != power)
+    {
+        _smooth_power = power;
+        _smooth_exp = b();
+        _smooth_exp.power(power);
+    }
+    return _smooth_exp;
+}
+
+void MultipointExp::window_recode(const arithmetic::Giant& exp, int W)
+{
+    _window_exp = exp;
+    _window_W = W;
+    _window_code.clear();
+
+    int i = exp.bitlen() - 1;
+    int j, ui;
+    int squares = 0;
+    while (i >= 0)
+    {
+        if (exp.bit(i) == 0)
+        {
+            squares++;
+            i--;
+            continue;
+        }
+        j = i - W + 1;
+        if (j < 0)
+            j = 0;
+        for (; exp.bit(j) == 0; j++);
+        ui = 0;
+        while (i >= j)
+        {
+            if (!_window_code.empty())
+                squares++;
+            ui <<= 1;
+            ui += exp.bit(i) ? 1 : 0;
+            i--;
+        }
+        _window_code.emplace_back(squares, ui);
+        squares = 0;
+    }
+    if (squares > 0)
+        _window_code.emplace_back(squares, 0);
+}
+
 void MultipointExp::sliding_window(const arithmetic::Giant& exp)
 {
     int len = exp.bitlen() - 1;
     int W = slide_init(len);
+    if (W != _window_W || _window_exp != exp)
+        window_recode(exp, W);
 
-    int i = len;
-    int j = i - W + 1;
-    if (j < 0)
-        j = 0;
-    for (; exp.bit(j) == 0; j++);
-    int ui = 0;
-    while (i >= j)
+    X() = _U[_window_code[0].second/2];
+    for (size_t k = 1; k < _window_code.size(); k++)
     {
-        ui <<= 1;
-        ui += exp.bit(i) ? 1 : 0;
-        i--;
+        bool last = k + 1 == _window_code.size();
+        int squares = _window_code[k].first;
+        int ui = _window_code[k].second;
+        for (int j = 0; j < squares; j++)
+            gw().square(X(), X(), GWMUL_STARTNEXTFFT_IF(!last || j + 1 < squares || ui != 0));
+        if (ui != 0)
+            gw().mul(_U[ui/2], X(), X(), GWMUL_FFT_S1 | GWMUL_STARTNEXTFFT_IF(!last));
     }
-    X() = _U[ui/2];
-
-    slide(exp, len - i - 1, len, false, W);
 }
 
 double MultipointExp::cost()
@@ -362,23 +619,22 @@ double MultipointExp::cost()
         int first = 0;
         if (_points[0].pos == 0)
             first = 1;
-        for (W = 2; (W < _W || _W == -1) && ((1 << (W + 1)) <= _max_size || _max_size == -1) && (1 << (W - 1)) + log2b*_points[first].pos*(1 + 1/(W + 1.0)) >(1 << (W - 0)) + log2b*_points[first].pos*(1 + 1/(W + 2.0)); W++);
-        double cost = ((1 << (W - 1)) + log2b*_points[first].pos*(1 + 1/(W + 1.0)));
+        W = window_size(log2b*_points[first].pos, 2);
+        double cost = ((1 << (W - 1))*_mul_cost + log2b*_points[first].pos*(1 + _mul_cost/(W + 1.0)));
         if (_points.size() > 1 + first)
         {
             cost *= (double)(_points.size() - 1 - first);
             int last = _points[_points.size() - 1].pos - _points[_points.size() - 2].pos;
-            for (W = 2; (W < _W || _W == -1) && ((1 << (W + 1)) <= _max_size || _max_size == -1) && (1 << (W - 1)) + log2b*last*(1 + 1/(W + 1.0)) >(1 << (W - 0)) + log2b*last*(1 + 1/(W + 2.0)); W++);
-            cost += ((1 << (W - 1)) + log2b*last*(1 + 1/(W + 1.0)));
+            W = window_size(log2b*last, 2);
+            cost += ((1 << (W - 1))*_mul_cost + log2b*last*(1 + _mul_cost/(W + 1.0)));
         }
         return cost;
     }
     else
     {
         int len = _exp.bitlen() - 1;
-        int W;
-        for (W = 2; (W < _W || _W == -1) && ((1 << (W + 1)) <= _max_size || _max_size == -1) && (1 << (W - 1)) + len*(1 + 1/(W + 1.0)) >(1 << (W - 0)) + len*(1 + 1/(W + 2.0)); W++);
-        return (1 << (W - 1)) + _points.back().pos*(1 + 1/(W + 1.0));
+        int W = window_size(len, 2);
+        return (1 << (W - 1))*_mul_cost + _points.back().pos*(1 + _mul_cost/(W + 1.0));
     }
 }
 
@@ -408,16 +664,14 @@ double StrongCheckMultipointExp::cost()
     else if (smooth())
     {
         double log2b = log2(b());
-        int W;
-        for (W = 2; (W < _W || _W == -1) && ((1 << (W + 1)) <= _max_size || _max_size == -1) && (1 << (W - 1)) + log2b*_L*(1 + 1/(W + 1.0)) >(1 << (W - 0)) + log2b*_L*(1 + 1/(W + 2.0)); W++);
-        return n/_L + (n/_L + n/_L2)*((1 << (W - 1)) + log2b*_L*(1 + 1/(W + 1.0)));
+        int W = window_size(log2b*_L, 2);
+        return n/_L + (n/_L + n/_L2)*((1 << (W - 1))*_mul_cost + log2b*_L*(1 + _mul_cost/(W + 1.0)));
     }
     else
     {
         int len = _exp.bitlen() - 1;
-        int W;
-        for (W = 2; (W < _W || _W == -1) && ((1 << (W + 1)) <= _max_size || _max_size == -1) && (1 << (W - 1)) + len*(1 + 1/(W + 1.0)) >(1 << (W - 0)) + len*(1 + 1/(W + 2.0)); W++);
-        return (1 << (W - 1)) + n*(1 + 1/(W + 1.0)) + n/_L + n/_L2*(_L + std::log2(_L2/_L))*(1 + 1/(W + 1.0));
+        int W = window_size(len, 2);
+        return (1 << (W - 1))*_mul_cost + n*(1 + _mul_cost/(W + 1.0)) + n/_L + n/_L2*(_L + std::log2(_L2/_L))*(1 + _mul_cost/(W + 1.0));
     }
 }
 
@@ -478,16 +732,16 @@ void StrongCheckMultipointExp::setup()
 {
     MultipointExp::setup();
     if (!_R)
-        _R.reset(new GWNum(gw()));
+        pool_alloc(_R);
     if (!_D)
-        _D.reset(new GWNum(gw()));
+        pool_alloc(_D);
 }
 
 void StrongCheckMultipointExp::release()
 {
     _recovery_op = 0;
-    _R.reset();
-    _D.reset();
+    pool_free(_R);
+    pool_free(_D);
     MultipointExp::release();
 }
 
@@ -498,8 +752,6 @@ void StrongCheckMultipointExp::execute()
 
     int i, j, next_point, next_check;
     int len;
-    Giant exp;
-    int last_power = -1;
     Giant tmp;
     Giant tmp2;
     State* tmp_state;
@@ -542,8 +794,8 @@ void StrongCheckMultipointExp::execute()
     else
     {
         i = state_check()->iteration();
-        X() = state_check()->X();
-        D() = state_check()->D();
+        state_check()->X().to_GWNum(X());
+        state_check()->D().to_GWNum(D());
     }
     if (i < 30)
         gwset_carefully_count(gw().gwdata(), 30 - i);
@@ -561,7 +813,6 @@ void StrongCheckMultipointExp::execute()
             else
                 L /= 2;
             L2 = L*L;
-            last_power = -1;
             for (next_check = next_point; !_points[next_check].check; next_check++);
         }
         if (i - state()->iteration() > L2)
@@ -604,13 +855,7 @@ void StrongCheckMultipointExp::execute()
             GWASSERT((i - state()->iteration())%L == 0);
             for (j = i - state()->iteration(); j < L2; j += L, i += L, Task::commit_execute<StrongCheckState>(i, state()->iteration(), X(), D()))
             {
-                if (last_power != L)
-                {
-                    last_power = L;
-                    exp = b();
-                    exp.power(last_power);
-                }
-                sliding_window(exp);
+                sliding_window(smooth_power(L));
                 if (j + L != L2 && i + L == _points[next_point].pos && !_points[next_point].check)
                 {
                     check();
@@ -682,13 +927,7 @@ void StrongCheckMultipointExp::execute()
         {
             GWArithmetic* tmpgw = _gw;
             _gw = &gw().carefully();
-            if (last_power != L)
-            {
-                last_power = L;
-                exp = b();
-                exp.power(last_power);
-            }
-            sliding_window(exp);
+            sliding_window(smooth_power(L));
             _gw = tmpgw;
         }
         if (!smooth())
@@ -823,3 +1062,44 @@ void StrongCheckMultipointExp::execute()
 
     done();
 }
+
+void parallel_for(int count, int threads, const std::function<void(int)>& task)
+{
+    std::atomic<int> index(0);
+    auto worker = [&]()
+    {
+        for (int i; (i = index++) < count; )
+            task(i);
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads && t < count; t++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& thread : pool)
+        thread.join();
+}
+
+Giant product_tree(std::vector<Giant>& values, int threads)
+{
+    Giant res;
+    if (values.empty())
+    {
+        res = 1;
+        return res;
+    }
+    while (values.size() > 1)
+    {
+        size_t pairs = values.size()/2;
+        // Lower levels consist of short products, threads pay off only near the root.
+        parallel_for((int)pairs, values[0].size() < 256 ? 1 : threads, [&](int i) { values[2*i] *= values[2*i + 1]; });
+
+        for (size_t i = 1; i < pairs; i++)
+            values[i] = std::move(values[2*i]);
+        if (values.size() & 1)
+            values[pairs] = std::move(values.back());
+        values.resize((values.size() + 1)/2);
+    }
+    res = std::move(values[0]);
+    values.clear();
+    return res;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <functional>
+#include <string>
 #include "arithmetic.h"
 #include "group.h"
 #include "integer.h"
@@ -8,6 +9,57 @@
 #include "task.h"
 #include "file.h"
 
+// Free list of GWNum buffers for a sequence of tasks on the same GWState.
+// Has to be destroyed before the GWState is done.
+class GWNumPool
+{
+public:
+    void alloc(arithmetic::GWArithmetic& gw, std::unique_ptr<arithmetic::GWNum>& X);
+    void alloc(arithmetic::GWArithmetic& gw, std::vector<arithmetic::GWNum>& U);
+    void free(std::unique_ptr<arithmetic::GWNum>& X);
+    void free(std::vector<arithmetic::GWNum>& U);
+    void clear() { _free.clear(); }
+    void report(Logging& logging);
+
+private:
+    std::vector<arithmetic::GWNum> _free;
+    int _allocated = 0;
+    int _reused = 0;
+    int _used = 0;
+    int _peak = 0;
+};
+
+// Thrown by PortableGWNum::to_GWNum() for a value written with another FFT and not migrated.
+class CheckpointFFTException : public TaskAbortException
+{
+};
+
+// SerializedGWNum is valid only for the FFT it was written with, its fingerprint is written after it.
+// After -migrate a canonical Giant copy follows, so the checkpoint can be loaded with a different FFT or on a different CPU.
+class PortableGWNum
+{
+public:
+    PortableGWNum& operator = (const arithmetic::GWNum& X);
+    void to_GWNum(arithmetic::GWNum& X);
+    // Computes the canonical copy of a value read with the FFT it was written with, false if it was written with another one.
+    bool migrate(arithmetic::GWArithmetic& gw);
+    bool portable() { return _canonical; }
+
+    bool read(Reader& reader) { _fft = 0; _canonical = false; return reader.read(_serialized); }
+    void write(Writer& writer) { writer.write(_serialized); }
+    // The tails follow all other fields of a state. A state written before them has none, otherwise a missing tail fails the read.
+    static bool read_values(Reader& reader, std::initializer_list<PortableGWNum*> values);
+    static void write_values(Writer& writer, std::initializer_list<PortableGWNum*> values);
+
+    static int fft_fingerprint(arithmetic::GWState& gwstate) { return (int)File::unique_fingerprint(0, gwstate.fft_description); }
+
+private:
+    arithmetic::SerializedGWNum _serialized;
+    arithmetic::Giant _value;
+    int _fft = 0;
+    bool _canonical = false;
+};
+
 class BaseExp : public InputTask
 {
 public:
@@ -29,12 +81,13 @@ public:
         static const char TYPE = 8;
         StateSerialized() : State(TYPE) { }
         void set(int iteration, arithmetic::GWNum& X) override { TaskState::set(iteration); _serialized_value = X; }
-        void to_GWNum(arithmetic::GWNum& X) override { X = _serialized_value; }
-        bool read(Reader& reader) override { return TaskState::read(reader) && reader.read(_serialized_value); }
-        void write(Writer& writer) override { TaskState::write(writer); writer.write(_serialized_value); }
+        void to_GWNum(arithmetic::GWNum& X) override { _serialized_value.to_GWNum(X); }
+        bool migrate(arithmetic::GWArithmetic& gw) { return _serialized_value.migrate(gw); }
+        bool read(Reader& reader) override { return TaskState::read(reader) && _serialized_value.read(reader) && PortableGWNum::read_values(reader, {&_serialized_value}); }
+        void write(Writer& writer) override { TaskState::write(writer); _serialized_value.write(writer); PortableGWNum::write_values(writer, {&_serialized_value}); }
 
     private:
-        arithmetic::SerializedGWNum _serialized_value;
+        PortableGWNum _serialized_value;
     };
     class StateValue : public State
     {
@@ -67,7 +120,7 @@ public:
     template<class... Args>
     void commit_execute(int iteration, Args&&... args)
     {
-        if (iteration == iterations())
+        if (iteration == iterations() && !_result_fft)
             Task::commit_execute<StateValue>(iteration, std::forward<Args>(args)...);
         else
             Task::commit_execute<StateSerialized>(iteration, std::forward<Args>(args)...);
@@ -82,11 +135,30 @@ public:
     arithmetic::Giant& X0() { return !_smooth ? _X0 : *(arithmetic::Giant*)nullptr; }
     uint32_t x0() { return !_smooth ? _x0 : 0; }
 
+    void set_pool(GWNumPool* pool) { _pool = pool; }
+
+    // Leaves the result in result_fft() instead of converting it to Giant.
+    void set_result_fft(bool result_fft) { _result_fft = result_fft; }
+    std::unique_ptr<arithmetic::GWNum>& result_fft() { return _result_X; }
+
 protected:
+    bool has_X0() { return !_X0.empty() || _X0_fft != nullptr; }
+    void set_X0(arithmetic::GWNum& X) { if (_X0_fft != nullptr) X = *_X0_fft; else X = _X0; }
+
+    void pool_alloc(std::unique_ptr<arithmetic::GWNum>& X) { if (_pool != nullptr) _pool->alloc(gw(), X); else X.reset(new arithmetic::GWNum(gw())); }
+    void pool_alloc(std::vector<arithmetic::GWNum>& U) { if (_pool != nullptr) _pool->alloc(gw(), U); else U.emplace_back(gw()); }
+    void pool_free(std::unique_ptr<arithmetic::GWNum>& X) { if (_pool != nullptr && X) _pool->free(X); X.reset(); }
+    void pool_free(std::vector<arithmetic::GWNum>& U) { if (_pool != nullptr) _pool->free(U); U.clear(); }
+
+protected:
+    GWNumPool* _pool = nullptr;
     bool _smooth;
     arithmetic::Giant _exp;
     arithmetic::Giant _tail;
     arithmetic::Giant _X0;
+    arithmetic::GWNum* _X0_fft = nullptr;
+    bool _result_fft = false;
+    std::unique_ptr<arithmetic::GWNum> _result_X;
     uint32_t _x0 = 0;
 };
 
@@ -94,7 +166,7 @@ class CarefulExp : public BaseExp
 {
 public:
     template<class T>
-    CarefulExp(T&& exp) : BaseExp()
+    CarefulExp(T&& exp, bool carefully = true) : BaseExp(), _carefully(carefully)
     {
         _smooth = false;
         _exp = std::forward<T>(exp);
@@ -125,14 +197,27 @@ public:
         _tail = std::forward<T>(tail);
         init(input, gwstate, logging);
     }
+    // X0 stays owned by the caller and has to outlive the task.
+    void init_fft(InputNum* input, arithmetic::GWState* gwstate, Logging* logging, arithmetic::GWNum& X0)
+    {
+        _X0_fft = &X0;
+        init(input, gwstate, logging);
+    }
 
-    double cost() override { return _exp.bitlen()*1.5; }
+    double cost() override { return _exp.bitlen()*(_carefully ? 1.5 : 1.0); }
+
+    // Fast mode leaves verification to the caller, which switches to careful mode on mismatch.
+    bool carefully() { return _carefully; }
+    void set_carefully(bool carefully) { _carefully = carefully; }
 
 protected:
     void init(InputNum* input, arithmetic::GWState* gwstate, Logging* logging);
     void execute() override;
     void setup() override { }
     void release() override { }
+
+protected:
+    bool _carefully;
 };
 
 class MultipointExp : public BaseExp
@@ -198,21 +283,36 @@ public:
         _tail = std::forward<T>(tail);
         init(input, gwstate, file, logging);
     }
+    void init_fft(InputNum* input, arithmetic::GWState* gwstate, File* file, Logging* logging, arithmetic::GWNum& X0)
+    {
+        GWASSERT(!smooth());
+        _X0_fft = &X0;
+        init(input, gwstate, file, logging);
+    }
 
     double cost() override;
-    int _W = 5;
+    // Window parameters for cost() before setup(), from the bitlen of N.
+    void window_estimate(int bitlen);
+    int _W = 0; // 0 = auto, -1 = unlimited
     int _max_size = -1;
     std::vector<Point>& points() { return _points; }
 
+    static int MEMORY_LIMIT; // MB available for the window table, 0 = no limit
+
 protected:
     void init(InputNum* input, arithmetic::GWState* gwstate, File* file, Logging* logging);
     void setup() override;
     void release() override;
     void execute() override;
 
+    void window_measure();
+    // The cost() estimates start at W = 2, slide_init() at W = 1.
+    int window_size(double len, int min_W = 1);
     int slide_init(int len);
     void slide(const arithmetic::Giant& exp, int start, int end, bool commit, int W = 0);
     void sliding_window(const arithmetic::Giant& exp);
+    void window_recode(const arithmetic::Giant& exp, int W);
+    arithmetic::Giant& smooth_power(int power);
 
     arithmetic::GWNum& X() { return *_X; }
 
@@ -222,6 +322,17 @@ protected:
 
     std::unique_ptr<arithmetic::GWNum> _X;
     std::vector<arithmetic::GWNum> _U;
+    double _mul_cost = 1.0;
+    std::string _mul_cost_fft;
+    int _mem_size = -1;
+    int _last_W = 0;
+
+    // b^power of the smooth path and its window recoding, kept across blocks and restarts.
+    int _smooth_power = -1;
+    arithmetic::Giant _smooth_exp;
+    arithmetic::Giant _window_exp;
+    int _window_W = 0;
+    std::vector<std::pair<int, int>> _window_code;
 };
 
 class SmoothExp : public MultipointExp
@@ -243,6 +354,7 @@ public:
     }
 
 private:
+    using MultipointExp::init_fft;
     using MultipointExp::init_giant;
     using MultipointExp::init_small;
     using MultipointExp::init_smooth;
@@ -268,6 +380,7 @@ public:
     }
 
 private:
+    using MultipointExp::init_fft;
     using MultipointExp::init_giant;
     using MultipointExp::init_small;
     using MultipointExp::init_smooth;
@@ -292,8 +405,13 @@ public:
     {
         init_giant(input, gwstate, file, logging, std::forward<T>(X0), std::forward<T>(tail));
     }
+    void init(InputNum* input, arithmetic::GWState* gwstate, File* file, Logging* logging, arithmetic::GWNum& X0)
+    {
+        init_fft(input, gwstate, file, logging, X0);
+    }
 
 private:
+    using MultipointExp::init_fft;
     using MultipointExp::init_giant;
     using MultipointExp::init_small;
     using MultipointExp::init_smooth;
@@ -309,15 +427,16 @@ public:
         StrongCheckState() : TaskState(TYPE) { }
         void set(int iteration, int recovery, arithmetic::GWNum& X, arithmetic::GWNum& D) { TaskState::set(iteration); _recovery = recovery; _X = X; _D = D; }
         int recovery() { return _recovery; }
-        arithmetic::SerializedGWNum& X() { return _X; }
-        arithmetic::SerializedGWNum& D() { return _D; }
-        bool read(Reader& reader) override { return TaskState::read(reader) && reader.read(_recovery) && reader.read(_X) && reader.read(_D); }
-        void write(Writer& writer) override { TaskState::write(writer); writer.write(_recovery); writer.write(_X); writer.write(_D); }
+        PortableGWNum& X() { return _X; }
+        PortableGWNum& D() { return _D; }
+        bool migrate(arithmetic::GWArithmetic& gw) { return _X.migrate(gw) && _D.migrate(gw); }
+        bool read(Reader& reader) override { return TaskState::read(reader) && reader.read(_recovery) && _X.read(reader) && _D.read(reader) && PortableGWNum::read_values(reader, {&_X, &_D}); }
+        void write(Writer& writer) override { TaskState::write(writer); writer.write(_recovery); _X.write(writer); _D.write(writer); PortableGWNum::write_values(writer, {&_X, &_D}); }
 
     private:
         int _recovery;
-        arithmetic::SerializedGWNum _X;
-        arithmetic::SerializedGWNum _D;
+        PortableGWNum _X;
+        PortableGWNum _D;
     };
 
 public:
@@ -428,6 +547,10 @@ protected:
 
     std::unique_ptr<arithmetic::GWNum> _R;
     std::unique_ptr<arithmetic::GWNum> _D;
+
+private:
+    // The check is verified against exact values, the base has to be a Giant.
+    using MultipointExp::init_fft;
 };
 
 class GerbiczCheckExp : public StrongCheckMultipointExp
@@ -541,6 +664,15 @@ private:
     using LiCheckExp::init_small;
 };
 
+// Runs task(0), ..., task(count - 1) on up to threads threads, the calling thread included, and returns when all are done.
+// Tasks may use Giants concurrently as long as they don't share them: the default arithmetic is GMP, which keeps no state
+// between calls, and it is created by the main thread before any task runs. GWNums need a GWState per thread.
+void parallel_for(int count, int threads, const std::function<void(int)>& task);
+
+// Multiplies values pairwise level by level, so operands of each multiplication have similar sizes.
+// Products of the same level are independent and run on up to threads threads. Values are consumed.
+arithmetic::Giant product_tree(std::vector<arithmetic::Giant>& values, int threads = 1);
+
 class Product : public InputTask
 {
 public:
@@ -1,5 +1,6 @@
 
 #include <cmath>
+#include <algorithm>
 #include <string.h>
 
 #include "gwnum.h"
@@ -103,9 +104,55 @@ int genProthBase(Giant& k, uint32_t n) {
 }
 // END LLR code
 
+bool Fermat::smooth_valid(InputNum& input)
+{
+    return input.type() == InputNum::KBNC && input.b() == 2 && log2(input.gk()) < input.n();
+}
+
+bool Fermat::smooth_checked(Giant& exp, InputNum& input, Options& options)
+{
+    if (!(options.CheckStrong ? options.CheckStrong.value() : true))
+        return false;
+    int checks = options.StrongCount ? options.StrongCount.value() : 16;
+    LiCheckExp task(exp, checks, options.StrongL ? options.StrongL.value() : 0);
+    task.window_estimate(input.bitlen());
+    return task.cost() < exp.bitlen()*1.5;
+}
+
+bool Fermat::smooth(InputNum& input, Options& options)
+{
+    if (!smooth_valid(input))
+        return false;
+    if (options.Smooth)
+        return options.Smooth.value();
+    return cost(input, options, true) <= cost(input, options, false);
+}
+
+double Fermat::cost(InputNum& input, Options& options, bool smooth)
+{
+    bool CheckStrong = options.CheckStrong ? options.CheckStrong.value() : true;
+    if (!CheckStrong)
+        return input.bitlen();
+    int checks = options.StrongCount ? options.StrongCount.value() : 16;
+    int L = options.StrongL ? options.StrongL.value() : 0;
+    if (smooth)
+    {
+        GerbiczCheckExp task(input.gb(), input.n(), checks, nullptr, L);
+        LiCheckExp task_k(input.gk(), checks, L);
+        task.window_estimate(input.bitlen());
+        task_k.window_estimate(input.bitlen());
+        return task.cost() + std::min(1.5*log2(input.gk()), task_k.cost());
+    }
+    Giant exp;
+    exp = 1;
+    exp <<= input.bitlen() - 1;
+    FastLiCheckExp task(std::move(exp), checks, L);
+    return task.cost();
+}
+
 Fermat::Fermat(int type, InputNum& input, Options& options, Logging& logging, Proof* proof) : Run("Fermat test", input, options)
 {
-    bool smooth = (input.type() == InputNum::KBNC && input.b() == 2 && log2(input.gk()) < 1000 && log2(input.gk()) < input.n()/4);
+    bool smooth = Fermat::smooth(input, options);
     uint32_t n = input.n();
     Giant exp;
     Giant exp_fermat;
@@ -115,34 +162,26 @@ Fermat::Fermat(int type, InputNum& input, Options& options, Logging& logging, Pr
 
     if (type != FERMAT)
     {
-        Giant exp_pocklington;
-        exp = 1;
-        exp_pocklington = 1;
-        exp_fermat = 1;
+        std::vector<Giant> exp_values;
+        std::vector<Giant> pocklington_values;
+        std::vector<Giant> fermat_values;
         n = 0;
 
         for (auto& factor : input.factors())
             if (factor.first == 2)
                 n = factor.second;
-            else
+            else if (type == POCKLINGTON)
             {
-                Giant divisor;
-                if (type == POCKLINGTON)
+                fermat_values.emplace_back() = factor.first;
+                exp_values.emplace_back() = factor.first;
+                if (factor.second > 1)
                 {
-                    exp_fermat *= factor.first;
-                    if (factor.second > 1)
-                    {
-                        divisor = power(factor.first, factor.second - 1);
-                        exp_pocklington *= divisor;
-                        divisor *= factor.first;
-                    }
-                    else
-                        divisor = factor.first;
+                    pocklington_values.emplace_back(power(factor.first, factor.second - 1));
+                    exp_values.emplace_back() = pocklington_values.back();
                 }
-                else
-                    divisor = power(factor.first, factor.second);
-                exp *= divisor;
             }
+            else
+                exp_values.emplace_back(power(factor.first, factor.second));
         if (n == 0)
         {
             _factor = 2;
@@ -151,10 +190,13 @@ Fermat::Fermat(int type, InputNum& input, Options& options, Logging& logging, Pr
         }
         if (!input.cofactor().empty())
         {
-            exp *= input.cofactor();
+            exp_values.emplace_back() = input.cofactor();
             if (type == POCKLINGTON)
-                exp_pocklington *= input.cofactor();
+                pocklington_values.emplace_back() = input.cofactor();
         }
+        exp = product_tree(exp_values, options.thread_count);
+        Giant exp_pocklington = product_tree(pocklington_values, options.thread_count);
+        exp_fermat = product_tree(fermat_values, options.thread_count);
 
         if (log2(exp) < n)
         {
@@ -189,7 +231,7 @@ Fermat::Fermat(int type, InputNum& input, Options& options, Logging& logging, Pr
             _a = options.FermatBase ? options.FermatBase.value() : 3;
 
         if (exp_fermat != 1)
-            _task_fermat_simple.reset(new CarefulExp(std::move(exp_fermat)));
+            _task_fermat_simple.reset(new CarefulExp(std::move(exp_fermat), false));
 
         if (!smooth)
             exp <<= n;
@@ -209,7 +251,9 @@ Fermat::Fermat(int type, InputNum& input, Options& options, Logging& logging, Pr
         _name = "Proth test";
     if (_type == POCKLINGTON)
         _name = "Pocklington test";
-    _fingerprint = File::unique_fingerprint(input.fingerprint(), std::to_string(_a));
+    // The smooth path checkpoints a different exponent chain.
+    _smooth = smooth;
+    _fingerprint = File::unique_fingerprint(input.fingerprint(), std::to_string(_a) + (smooth ? ".smooth" : ""));
     logging.report_param("maxmulbyconst", 1);
 
     if (proof == nullptr && !CheckStrong)
@@ -232,7 +276,9 @@ Fermat::Fermat(int type, InputNum& input, Options& options, Logging& logging, Pr
 
             if (input.c() != 1)
                 _task_tail_simple.reset(new CarefulExp(std::abs(input.c() - 1)));
-            if (exp != 1)
+            if (exp != 1 && smooth_checked(exp, input, options))
+                _task_ak.reset(new LiCheckExp(std::move(exp), checks, options.StrongL ? options.StrongL.value() : 0));
+            else if (exp != 1)
                 _task_ak_simple.reset(new CarefulExp(std::move(exp)));
         }
         else
@@ -240,6 +286,8 @@ Fermat::Fermat(int type, InputNum& input, Options& options, Logging& logging, Pr
             _task.reset(new FastLiCheckExp(std::move(exp), checks, options.StrongL ? options.StrongL.value() : 0));
             logging.report_param("maxmulbyconst", _a);
         }
+        if (_task_ak)
+            logging.progress().add_stage(_task_ak->cost());
         logging.progress().add_stage(_task->cost());
     }
     else
@@ -287,13 +335,17 @@ Fermat::Fermat(int type, InputNum& input, Options& options, Logging& logging, Pr
 
             if (input.c() != 1)
                 _task_tail_simple.reset(new CarefulExp(std::abs(input.c() - 1)));
-            if (exp != 1)
+            if (exp != 1 && smooth_checked(exp, input, options))
+                _task_ak.reset(new LiCheckExp(std::move(exp), options.StrongCount ? options.StrongCount.value() : 16, options.StrongL ? options.StrongL.value() : 0));
+            else if (exp != 1)
                 _task_ak_simple.reset(new CarefulExp(std::move(exp)));
         }
         if (options.ProofPointWriteMode)
             for (int i = 1; i < proof->count(); i++)
                 _task->points()[i].value = options.ProofPointWriteMode.value();
 
+        if (_task_ak)
+            logging.progress().add_stage(_task_ak->cost());
         logging.progress().add_stage(_task->cost());
         logging.progress().add_stage(proof->cost());
     }
@@ -303,6 +355,8 @@ Fermat::Fermat(int type, InputNum& input, Options& options, Logging& logging, Pr
         _task_tail_simple->set_error_check(false, true);
     if (_task_ak_simple)
         _task_ak_simple->set_error_check(false, true);
+    if (_task_ak)
+        _task_ak->set_error_check(!options.CheckNear || options.CheckNear.value(), options.Check && options.Check.value());
     if (_task_fermat_simple)
         _task_fermat_simple->set_error_check(false, true);
 }
@@ -373,9 +427,23 @@ void Fermat::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file
         _task->init_small(&input, &gwstate, &file_checkpoint, &logging, _a, std::move(tail));
     if (proof != nullptr)
         proof->init_state(_task.get(), gwstate, input, logging, _a);
+    File* checkpoint_ak = nullptr;
+    File* recoverypoint_ak = nullptr;
+    if (_task_ak)
+    {
+        checkpoint_ak = file_checkpoint.add_child("k", File::unique_fingerprint(file_checkpoint.fingerprint(), "k"));
+        recoverypoint_ak = file_recoverypoint.add_child("k", File::unique_fingerprint(file_recoverypoint.fingerprint(), "k"));
+    }
     if (_task->smooth() && _task->state() == nullptr)
     {
-        if (_task_ak_simple)
+        if (_task_ak)
+        {
+            _task_ak->init(&input, &gwstate, checkpoint_ak, recoverypoint_ak, &logging, std::move(ak));
+            _task_ak->run();
+            ak = std::move(*_task_ak->result());
+            logging.progress().next_stage();
+        }
+        else if (_task_ak_simple)
         {
             _task_ak_simple->init_giant(&input, &gwstate, &logging, std::move(ak));
             _task_ak_simple->run();
@@ -394,15 +462,28 @@ void Fermat::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file
         if (proof != nullptr)
             _task->state()->set_written();
     }
+    else if (_task_ak)
+        logging.progress().next_stage();
     if (proof != nullptr && proof->file_points().size() > 0 && dynamic_cast<FilePacked*>(proof->file_points().front()) != nullptr)
         dynamic_cast<FilePacked*>(proof->file_points().front())->container().close();
 
     _task->run();
+    if (_task_ak)
+    {
+        checkpoint_ak->clear();
+        recoverypoint_ak->clear();
+    }
 
     if (_task_fermat_simple)
     {
         _task_fermat_simple->init_giant(&input, &gwstate, &logging, *_task->result());
         _task_fermat_simple->run();
+        if (*_task_fermat_simple->result() != 1 && !_task_fermat_simple->carefully())
+        {
+            _task_fermat_simple->set_carefully(true);
+            _task_fermat_simple->init_giant(&input, &gwstate, &logging, *_task->result());
+            _task_fermat_simple->run();
+        }
         if (*_task_fermat_simple->result() == 1)
             _success = true;
     }
@@ -428,7 +509,7 @@ void Fermat::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file
     logging.set_prefix("");
     logging.progress().next_stage();
 
-    if (type() != POCKLINGTON)
+    if (type() != POCKLINGTON && (_report_probable || !_success))
         primality_result(logging);
 
     if (proof != nullptr)
@@ -20,24 +20,38 @@ public:
     Fermat(int type, InputNum& input, Options& options, Logging& logging, Proof* proof);
     virtual ~Fermat() { }
 
+    // Smooth exponentiation raises to k first, then to b^n with the Gerbicz check.
+    static bool smooth_valid(InputNum& input);
+    static bool smooth(InputNum& input, Options& options);
+    // Smooth exponentiation raises to k with the Gerbicz-Li check when it's cheaper than careful exponentiation.
+    static bool smooth_checked(arithmetic::Giant& exp, InputNum& input, Options& options);
+    // Predicted cost of the main exponentiation in multiplications modulo N.
+    static double cost(InputNum& input, Options& options, bool smooth);
+
     void run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging) override;
     virtual void run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging, Proof* proof);
 
     int type() { return _type; }
     int a() { return _a; }
+    // Probable primes are not reported when a deterministic test follows.
+    void set_report_probable(bool report) { _report_probable = report; }
     arithmetic::Giant& result() { return *_task->result(); }
 
     CarefulExp* task_tail_simple() { return _task_tail_simple.get(); }
     CarefulExp* task_ak_simple() { return _task_ak_simple.get(); }
+    LiCheckExp* task_ak() { return _task_ak.get(); }
     CarefulExp* task_fermat_simple() { return _task_fermat_simple.get(); }
     MultipointExp* task() { return _task.get(); }
 
 protected:
     int _type;
     int _a;
+    bool _smooth = false;
+    bool _report_probable = true;
 
     std::unique_ptr<CarefulExp> _task_tail_simple;
     std::unique_ptr<CarefulExp> _task_ak_simple;
+    std::unique_ptr<LiCheckExp> _task_ak;
     std::unique_ptr<CarefulExp> _task_fermat_simple;
     std::unique_ptr<MultipointExp> _task;
 };
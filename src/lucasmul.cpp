@@ -17,6 +17,109 @@ void LucasVMul::done()
         _gwstate->mod(*result(), *result());
 }
 
+std::string DACCache::FILENAME;
+DACCache::State DACCache::_state;
+std::unique_ptr<File> DACCache::_file;
+bool DACCache::_loaded = false;
+bool DACCache::_changed = false;
+
+bool DACCache::State::read(Reader& reader)
+{
+    _table.clear();
+    if (!TaskState::read(reader))
+        return false;
+    for (int i = 0; i < iteration(); i++)
+    {
+        int prime, d, len;
+        if (!reader.read(prime) || !reader.read(d) || !reader.read(len))
+            return false;
+        _table[prime] = std::pair<int, int>(d, len);
+    }
+    return true;
+}
+
+void DACCache::State::write(Writer& writer)
+{
+    TaskState::set((int)_table.size());
+    TaskState::write(writer);
+    for (auto& entry : _table)
+    {
+        writer.write(entry.first);
+        writer.write(entry.second.first);
+        writer.write(entry.second.second);
+    }
+}
+
+void DACCache::load()
+{
+    _loaded = true;
+    if (FILENAME.empty())
+        return;
+    _file.reset(new File(FILENAME, 0));
+    if (!_file->read(_state))
+        _state.table().clear();
+}
+
+void DACCache::save()
+{
+    if (!_changed || !_file)
+        return;
+    _file->write(_state);
+    _changed = false;
+}
+
+int DACCache::search(int prime, int* len)
+{
+    *len = 60;
+    return get_DAC_S_d(prime, (int)(prime/1.618) - 100, (int)(prime/1.618) + 100, len);
+}
+
+int DACCache::find(int prime, int* len)
+{
+    if (!_loaded)
+        load();
+    auto it = _state.table().find(prime);
+    if (it == _state.table().end())
+    {
+        int d = search(prime, len);
+        it = _state.table().emplace(prime, std::pair<int, int>(d, *len)).first;
+        _changed = true;
+    }
+    *len = it->second.second;
+    return it->second.first;
+}
+
+void DACCache::find_all(const std::vector<int>& primes)
+{
+    if (!_loaded)
+        load();
+    static int last_precomputed = 0;
+    if (last_precomputed == 0)
+    {
+        auto it = PrimeIterator::get();
+        for (int i = 1; i < precomputed_DAC_S_d_len; i++, it++);
+        last_precomputed = *it;
+    }
+
+    std::vector<int> missing;
+    for (int prime : primes)
+        if (prime > last_precomputed && _state.table().count(prime) == 0)
+            missing.push_back(prime);
+    if (missing.empty())
+        return;
+    std::sort(missing.begin(), missing.end());
+    missing.erase(std::unique(missing.begin(), missing.end()), missing.end());
+
+    // get_DAC_S_d is not known to be reentrant, the searches run one after another.
+    for (int prime : missing)
+    {
+        int len;
+        int d = search(prime, &len);
+        _state.table()[prime] = std::pair<int, int>(d, len);
+    }
+    _changed = true;
+}
+
 int LucasVMulFast::mul_prime(int prime, int n, int index)
 {
     if (prime < 14)
@@ -27,8 +130,8 @@ int LucasVMulFast::mul_prime(int prime, int n, int index)
             for (auto it = PrimeIterator::get(); *it != prime && index < precomputed_DAC_S_d_len; index++, it++);
         if (index == 0 || index >= precomputed_DAC_S_d_len)
         {
-            int len = 60;
-            index = -get_DAC_S_d(prime, (int)(prime/1.618) - 100, (int)(prime/1.618) + 100, &len);
+            int len;
+            index = -DACCache::find(prime, &len);
         }
     }
     _primes.emplace_back(prime, n, index);
@@ -75,8 +178,13 @@ void LucasVMulFast::progress_init()
         case 13:
             len = 6; break;
         default:
-            int d = std::get<2>(prime) < 0 ? -std::get<2>(prime) : precomputed_DAC_S_d[std::get<2>(prime)];
-            get_DAC_S_d(std::get<0>(prime), d, d + 1, &len);
+            if (std::get<2>(prime) < 0)
+                DACCache::find(std::get<0>(prime), &len);
+            else
+            {
+                int d = precomputed_DAC_S_d[std::get<2>(prime)];
+                get_DAC_S_d(std::get<0>(prime), d, d + 1, &len);
+            }
         }
         _progress->add_stage(len*std::get<1>(prime));
     }
@@ -345,22 +453,24 @@ void LucasUVMul::execute()
                 lucas.set_gw(gw());
             if (pos + j == 30)
                 lucas.set_gw(gw().carefully());
+            // The source doubled next keeps its forward FFT from the addition, outside the careful bits.
+            bool fft_src = (i >= 30 && pos + j > 30);
             if (tmp.bit(j))
             {
                 DEBUG_INDEX(iX <<= 1);
                 DEBUG_INDEX(iX += 1);
                 if (V1)
-                    lucas.add(Vn1, Vn, *V1, Vn, GWMUL_STARTNEXTFFT_IF(!is_last(i)));
+                    lucas.add(Vn1, Vn, *V1, Vn, (fft_src ? GWMUL_FFT_S1 : 0) | GWMUL_STARTNEXTFFT_IF(!is_last(i)));
                 else
-                    lucas.add(Vn1, Vn, intP, Vn, GWMUL_STARTNEXTFFT_IF(!is_last(i)));
+                    lucas.add(Vn1, Vn, intP, Vn, (fft_src ? GWMUL_FFT_S1 : 0) | GWMUL_STARTNEXTFFT_IF(!is_last(i)));
                 lucas.dbl(Vn1, Vn1, GWMUL_STARTNEXTFFT_IF(!is_last(i) && j > 0));
             }
             else
             {
                 if (V1)
-                    lucas.add(Vn1, Vn, *V1, Vn1, GWMUL_STARTNEXTFFT_IF(!is_last(i) && j > 0));
+                    lucas.add(Vn1, Vn, *V1, Vn1, (fft_src ? GWMUL_FFT_S2 : 0) | GWMUL_STARTNEXTFFT_IF(!is_last(i) && j > 0));
                 else
-                    lucas.add(Vn1, Vn, intP, Vn1, GWMUL_STARTNEXTFFT_IF(!is_last(i) && j > 0));
+                    lucas.add(Vn1, Vn, intP, Vn1, (fft_src ? GWMUL_FFT_S2 : 0) | GWMUL_STARTNEXTFFT_IF(!is_last(i) && j > 0));
                 DEBUG_INDEX(iX <<= 1);
                 lucas.dbl(Vn, Vn, GWMUL_STARTNEXTFFT_IF(!is_last(i)));
             }
@@ -1,10 +1,49 @@
 #pragma once
 
+#include <map>
 #include "arithmetic.h"
 #include "inputnum.h"
 #include "task.h"
 #include "file.h"
 #include "lucas.h"
+#include "exp.h"
+
+// Best DAC chains for primes beyond the precomputed table, shared by all tests in the process.
+// With FILENAME set the table is also kept on disk between runs.
+class DACCache
+{
+public:
+    class State : public TaskState
+    {
+    public:
+        static const char TYPE = 12;
+        State() : TaskState(TYPE) { }
+        std::map<int, std::pair<int, int>>& table() { return _table; }
+        bool read(Reader& reader) override;
+        void write(Writer& writer) override;
+
+    private:
+        std::map<int, std::pair<int, int>> _table;
+    };
+
+    static std::string FILENAME;
+
+public:
+    // Returns d of the best chain for prime, len receives its length.
+    static int find(int prime, int* len);
+    // Searches chains for all missing primes, one after another: get_DAC_S_d is not known to be reentrant.
+    static void find_all(const std::vector<int>& primes);
+    static void save();
+
+private:
+    static void load();
+    static int search(int prime, int* len);
+
+    static State _state;
+    static std::unique_ptr<File> _file;
+    static bool _loaded;
+    static bool _changed;
+};
 
 class LucasVMul : public InputTask
 {
@@ -61,6 +100,9 @@ public:
     }
     int mul_prime(int prime, int n, int index = 0);
 
+    bool carefully() { return _carefully; }
+    void set_carefully(bool carefully) { _carefully = carefully; }
+
     std::vector<std::pair<arithmetic::Giant, int>>& giants() { return _giants; }
     std::vector<std::tuple<int, int, int>>& primes() { return _primes; }
 
@@ -131,17 +173,18 @@ public:
         StrongCheckState() : TaskState(TYPE) { }
         void set(int iteration, int recovery, const arithmetic::LucasV& Vn, const arithmetic::LucasV& Vn1, const arithmetic::LucasUV& D) { TaskState::set(iteration); _recovery = recovery; _Vn = Vn.V(); _Vn1 = Vn1.V(); _Vparity = Vn.parity(); _U = D.U(); _V = D.V(); _parity = D.parity(); }
         int recovery() { return _recovery; }
-        void to_Lucas(arithmetic::LucasV& Vn, arithmetic::LucasV& Vn1, arithmetic::LucasUV& D) { Vn.V() = _Vn; Vn1.V() = _Vn1; Vn.arithmetic().init(Vn.V(), _Vparity, Vn); Vn1.arithmetic().init(Vn1.V(), !_Vparity, Vn1); D.U() = _U; D.V() = _V; D.arithmetic().init(D.U(), D.V(), _parity, true, D); }
-        bool read(Reader& reader) override { int Vparity = 0, parity = 0; bool res = TaskState::read(reader) && reader.read(_recovery) && reader.read(_Vn) && reader.read(_Vn1) && reader.read(Vparity) && reader.read(_U) && reader.read(_V) && reader.read(parity); _Vparity = Vparity == 1; _parity = parity == 1; return res; }
-        void write(Writer& writer) override { TaskState::write(writer); writer.write(_recovery); writer.write(_Vn); writer.write(_Vn1); writer.write(_Vparity ? 1 : 0); writer.write(_U); writer.write(_V); writer.write(_parity ? 1 : 0); }
+        void to_Lucas(arithmetic::LucasV& Vn, arithmetic::LucasV& Vn1, arithmetic::LucasUV& D) { _Vn.to_GWNum(Vn.V()); _Vn1.to_GWNum(Vn1.V()); Vn.arithmetic().init(Vn.V(), _Vparity, Vn); Vn1.arithmetic().init(Vn1.V(), !_Vparity, Vn1); _U.to_GWNum(D.U()); _V.to_GWNum(D.V()); D.arithmetic().init(D.U(), D.V(), _parity, true, D); }
+        bool migrate(arithmetic::GWArithmetic& gw) { return _Vn.migrate(gw) && _Vn1.migrate(gw) && _U.migrate(gw) && _V.migrate(gw); }
+        bool read(Reader& reader) override { int Vparity = 0, parity = 0; bool res = TaskState::read(reader) && reader.read(_recovery) && _Vn.read(reader) && _Vn1.read(reader) && reader.read(Vparity) && _U.read(reader) && _V.read(reader) && reader.read(parity) && PortableGWNum::read_values(reader, {&_Vn, &_Vn1, &_U, &_V}); _Vparity = Vparity == 1; _parity = parity == 1; return res; }
+        void write(Writer& writer) override { TaskState::write(writer); writer.write(_recovery); _Vn.write(writer); _Vn1.write(writer); writer.write(_Vparity ? 1 : 0); _U.write(writer); _V.write(writer); writer.write(_parity ? 1 : 0); PortableGWNum::write_values(writer, {&_Vn, &_Vn1, &_U, &_V}); }
 
     private:
         int _recovery;
-        arithmetic::SerializedGWNum _Vn;
-        arithmetic::SerializedGWNum _Vn1;
+        PortableGWNum _Vn;
+        PortableGWNum _Vn1;
         bool _Vparity;
-        arithmetic::SerializedGWNum _U;
-        arithmetic::SerializedGWNum _V;
+        PortableGWNum _U;
+        PortableGWNum _V;
         bool _parity;
     };
 
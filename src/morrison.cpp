@@ -1,6 +1,7 @@
 
 #include <cmath>
 #include <algorithm>
+#include <chrono>
 #include <string.h>
 
 #include "gwnum.h"
@@ -109,20 +110,26 @@ Morrison::Morrison(InputNum& input, Options& options, Logging& logging) : Run("M
     }
 
     if (_factor_tasks.size() > 0)
-        _taskCheck.reset(new LucasVMulFast(true));
+        _taskCheck.reset(new LucasVMulFast());
     if (_factor_tasks.size() > 1)
-        for (auto& task : _factor_tasks)
-        {
-            task.taskFactor.reset(new LucasVMulFast(true));
-            task.taskCheck.reset(new LucasVMulFast(true));
-        }
+    {
+        std::vector<std::unique_ptr<FactorTree>> leaves;
+        for (auto i : _factor_tasks)
+            leaves.emplace_back(new FactorTree(input.factors()[i].first, i));
+        _tree.reset(new FactorTree(leaves));
+    }
+    std::vector<int> dac_primes;
+    for (auto& f : input.factors())
+        if (f.first.bitlen() < 32)
+            dac_primes.push_back((int)f.first.data()[0]);
+    DACCache::find_all(dac_primes);
     for (i = 0; i < input.factors().size(); i++)
     {
         Giant& b = input.factors()[i].first;
         if (b == 2 && _negQ)
             continue;
         n = input.factors()[i].second;
-        auto factor = std::find_if(_factor_tasks.begin(), _factor_tasks.end(), [&](auto& a) { return a.index == i; });
+        auto factor = std::find(_factor_tasks.begin(), _factor_tasks.end(), i);
         if (factor != _factor_tasks.end())
             n--;
 
@@ -133,34 +140,14 @@ Morrison::Morrison(InputNum& input, Options& options, Logging& logging) : Run("M
             if (taskV && n > 0)
                 index = taskV->mul_prime(prime, n);
             if (factor != _factor_tasks.end())
-            {
-                index = _taskCheck->mul_prime(prime, 1, index);
-                if (_factor_tasks.size() > 1)
-                    for (auto& task : _factor_tasks)
-                    {
-                        if (task.index == i)
-                            task.taskCheck->mul_prime(prime, 1, index);
-                        else
-                            task.taskFactor->mul_prime(prime, 1, index);
-                    }
-            }
+                _taskCheck->mul_prime(prime, 1, index);
         }
         else
         {
             if (taskV && n > 0)
                 taskV->mul_giant(b, n);
             if (factor != _factor_tasks.end())
-            {
                 _taskCheck->mul_giant(b, 1);
-                if (_factor_tasks.size() > 1)
-                    for (auto& task : _factor_tasks)
-                    {
-                        if (task.index == i)
-                            task.taskCheck->mul_giant(b, 1);
-                        else
-                            task.taskFactor->mul_giant(b, 1);
-                    }
-            }
         }
     }
 
@@ -168,6 +155,20 @@ Morrison::Morrison(InputNum& input, Options& options, Logging& logging) : Run("M
     logging.progress().add_stage(_task->cost());
 }
 
+double Morrison::cost(InputNum& input, Options& options)
+{
+    std::vector<double> costs;
+    double factors = 0;
+    for (auto& f : input.factors())
+        if (f.first != 2)
+        {
+            costs.push_back(f.first.bitlen());
+            factors += f.first.bitlen();
+        }
+    // Lucas sequences take two multiplications per bit. The walk of the factor tree raises the main result to the product of the other factors for each factor.
+    return 2*(input.bitlen() + FactorTree::walk_cost(costs) + factors + costs.size()) + Run::gcd_cost(input);
+}
+
 void Morrison::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging)
 {
     if (!_task)
@@ -229,13 +230,22 @@ void Morrison::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& fi
         }
         _task->run();
 
+        auto run_task = [&](LucasVMulFast* task, Giant& V, bool parity) {
+            task->init(&input, &gwstate, nullptr, &logging, _negQ);
+            task->init_state(new LucasVMulFast::State(0, 0, V, parity));
+            task->run();
+        };
+
         Giant* result = _task->result();
-        bool result_parity = _task->result_parity();
         if (_taskCheck)
         {
-            _taskCheck->init(&input, &gwstate, nullptr, &logging, _negQ);
-            _taskCheck->init_state(new LucasVMulFast::State(0, 0, *result, result_parity));
-            _taskCheck->run();
+            run_task(_taskCheck.get(), *_task->result(), _task->result_parity());
+            if (*_taskCheck->result() != (_negQ ? 0 : 2) && !_taskCheck->carefully())
+            {
+                logging.warning("Arithmetic error, repeating carefully.\n");
+                _taskCheck->set_carefully(true);
+                run_task(_taskCheck.get(), *_task->result(), _task->result_parity());
+            }
             result = _taskCheck->result();
         }
         logging.progress().next_stage();
@@ -262,42 +272,69 @@ void Morrison::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& fi
                     G -= 2;
                 if (G == 0)
                     continue;
-                factors_str += (!factors_str.empty() ? ", " : "") + input.factors()[_factor_tasks[0].index].first.to_string();
+                factors_str += (!factors_str.empty() ? ", " : "") + input.factors()[_factor_tasks[0]].first.to_string();
             }
             else
             {
                 std::vector<Giant> Gs;
-                for (auto& ftask : _factor_tasks)
-                {
-                    ftask.taskFactor->init(&input, &gwstate, nullptr, &logging, _negQ);
-                    ftask.taskFactor->init_state(new LucasVMulFast::State(0, 0, *_task->result(), _task->result_parity()));
-                    ftask.taskFactor->run();
-                    if (ftask.taskFactor->state()->V() == (_negQ ? 0 : 2))
+                std::vector<int> factors;
+                bool AllFactors = _options.AllFactors && _options.AllFactors.value();
+                bool carefully = false;
+                bool error = false;
+                FactorWalk<std::pair<Giant, bool>> walk([&](std::pair<Giant, bool>& X, Giant& exp)
+                    {
+                        LucasVMulFast task(carefully);
+                        task.mul_giant(exp, 1);
+                        run_task(&task, X.first, X.second);
+                        X.first = std::move(*task.result());
+                        X.second = task.result_parity();
+                    },
+                    [&](int index, std::pair<Giant, bool>& X, std::pair<Giant, bool>& check)
                     {
-                        if (_options.AllFactors && _options.AllFactors.value())
+                        if (check.first != (_negQ ? 0 : 2))
                         {
-                            done = 0;
-                            break;
+                            error = true;
+                            return false;
                         }
-                        continue;
+                        if (X.first == (_negQ ? 0 : 2))
+                            return !AllFactors;
+                        Gs.push_back(std::move(X.first));
+                        if (!_negQ)
+                            Gs.back() -= 2;
+                        factors.push_back(index);
+                        return true;
+                    });
+                while (true)
+                {
+                    Gs.clear();
+                    factors.clear();
+                    error = false;
+                    std::pair<Giant, bool> X;
+                    X.first = *_task->result();
+                    X.second = _task->result_parity();
+                    if (walk.run(_tree.get(), X))
+                        break;
+                    if (!error)
+                    {
+                        done = 0;
+                        break;
                     }
-                    ftask.taskCheck->init(&input, &gwstate, nullptr, &logging, _negQ);
-                    ftask.taskCheck->init_state(new LucasVMulFast::State(0, 0, *ftask.taskFactor->result(), ftask.taskFactor->result_parity()));
-                    ftask.taskCheck->run();
-                    if (ftask.taskCheck->state()->V() != (_negQ ? 0 : 2))
+                    if (carefully)
                     {
-                        logging.warning("Arithmetic error, restarting.");
+                        logging.warning("Arithmetic error, restarting.\n");
                         done = 0;
                         break;
                     }
-                    Gs.push_back(std::move(*ftask.taskFactor->result()));
-                    if (!_negQ)
-                        Gs.back() -= 2;
-                    done *= power(input.factors()[ftask.index].first, input.factors()[ftask.index].second);
-                    factors_str += (!factors_str.empty() ? ", " : "") + input.factors()[ftask.index].first.to_string();
+                    logging.warning("Arithmetic error, repeating carefully.\n");
+                    carefully = true;
                 }
                 if (done == 0)
                     continue;
+                for (auto i : factors)
+                {
+                    done *= power(input.factors()[i].first, input.factors()[i].second);
+                    factors_str += (!factors_str.empty() ? ", " : "") + input.factors()[i].first.to_string();
+                }
                 int n = _negQ ? input.factors()[0].second : 0;
                 if ((done.bitlen() + n)*2 + 10 < gwstate.N->bitlen())
                     continue;
@@ -340,6 +377,40 @@ void Morrison::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& fi
         recoverypoint->clear();
 }
 
+Triage::Triage(Fermat* prp, Run* run, InputNum& input, Options& options) : Run(input, options), _prp(prp), _run(run)
+{
+    _name = _prp->name() + ", " + _run->name();
+    _fingerprint = _run->fingerprint();
+    _prp->set_report_probable(false);
+}
+
+void Triage::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging)
+{
+    // The Lucas test reuses GWState, its files are separate from the Fermat test.
+    if (logging.progress().param("prp").empty())
+    {
+        File* checkpoint = file_checkpoint.add_child("prp", _prp->fingerprint());
+        File* recoverypoint = file_recoverypoint.add_child("prp", _prp->fingerprint());
+        _prp->run(gwstate, *checkpoint, *recoverypoint, logging);
+        if (!_prp->success())
+        {
+            _res64 = _prp->res64();
+            _factor = _prp->factor();
+            return;
+        }
+        logging.report_param("prp", "done");
+        logging.progress_save();
+    }
+    else
+        logging.progress().next_stage();
+
+    _run->run(gwstate, file_checkpoint, file_recoverypoint, logging);
+    _success = _run->success();
+    _prime = _run->prime();
+    _res64 = _run->res64();
+    _factor = _run->factor();
+}
+
 MorrisonGeneric::MorrisonGeneric(InputNum& input, Options& options, Logging& logging) : Run("generic Morrison test", input, options)
 {
     bool CheckStrong = options.CheckStrong ? options.CheckStrong.value() : true;
@@ -362,17 +433,16 @@ MorrisonGeneric::MorrisonGeneric(InputNum& input, Options& options, Logging& log
         it_p = it;
     }
 
-    Giant tmp;
-    Giant exp;
-    if (input.cofactor().empty())
-        exp = 1;
-    else
-        exp = input.cofactor();
-    _done = 1;
-    Giant tmp_exp;
-    tmp_exp = 1;
-    Giant tmp_done;
-    tmp_done = 1;
+    std::vector<Giant> exp_values;
+    std::vector<Giant> done_values;
+    if (!input.cofactor().empty())
+        exp_values.emplace_back() = input.cofactor();
+
+    std::vector<int> dac_primes;
+    for (auto& f : input.factors())
+        if (f.first.bitlen() < 32)
+            dac_primes.push_back((int)f.first.data()[0]);
+    DACCache::find_all(dac_primes);
 
     std::vector<std::unique_ptr<FactorTree>> factors;
     _dac_index.reserve(input.factors().size());
@@ -381,11 +451,7 @@ MorrisonGeneric::MorrisonGeneric(InputNum& input, Options& options, Logging& log
     {
         auto& f = input.factors()[i];
         if (_done_factors.count(i) != 0)
-        {
-            tmp = f.first;
-            tmp.power(f.second);
-            tmp_done *= tmp;
-        }
+            done_values.emplace_back(power(f.first, f.second));
         if (f.first.bitlen() < 32)
         {
             int& prime = (int&)*f.first.data();
@@ -399,50 +465,46 @@ MorrisonGeneric::MorrisonGeneric(InputNum& input, Options& options, Logging& log
             }
             else
             {
-                int len = 60;
-                _dac_index.push_back(-get_DAC_S_d(prime, (int)(prime/1.618) - 100, (int)(prime/1.618) + 100, &len));
+                int len;
+                _dac_index.push_back(-DACCache::find(prime, &len));
             }
         }
 
-        int power = f.second - 1;
+        int exp_power = f.second - 1;
         if (f.first == 2)
         {
-            _negQ = (power > 0);
+            _negQ = (exp_power > 0);
             if (!_negQ)
                 factors.emplace_back(new FactorTree(f.first, i));
         }
         else
             factors.emplace_back(new FactorTree(f.first, i));
-        if (power > 0)
-        {
-            tmp = f.first;
-            tmp.power(power);
-            tmp_exp *= tmp;
-        }
-        if (tmp_done.size() > 8192)
-        {
-            _done *= tmp_done;
-            tmp_done = 1;
-        }
-        if (tmp_exp.size() > 8192)
-        {
-            exp *= tmp_exp;
-            tmp_exp = 1;
-        }
+        if (exp_power > 0)
+            exp_values.emplace_back(power(f.first, exp_power));
     }
-    if (tmp_done != 1)
-        _done *= tmp_done;
-    if (tmp_exp != 1)
-        exp *= tmp_exp;
+    _done = product_tree(done_values, options.thread_count);
 
     _tree.reset(new FactorTree(factors));
-    _tree->exp() = std::move(exp);
+    _tree->exp() = product_tree(exp_values, options.thread_count);
 
     _logging.reset(new SubLogging(logging, logging.level() + 1));
     _logging->progress().set_parent(nullptr);
     logging.progress().add_stage(input.bitlen()*std::log2(input.factors().size()));
 }
 
+double MorrisonGeneric::cost(InputNum& input, Options& options)
+{
+    std::vector<double> costs;
+    double factors = 0;
+    for (auto& f : input.factors())
+    {
+        costs.push_back(f.first.bitlen());
+        factors += costs.back();
+    }
+    // Lucas sequences take two multiplications per bit.
+    return 2*(input.bitlen() - factors + FactorTree::walk_cost(costs) + costs.size()) + ((costs.size() + 99)/100)*Run::gcd_cost(input);
+}
+
 void MorrisonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging)
 {
     if (logging.progress().param_int("P") != 0)
@@ -464,6 +526,9 @@ void MorrisonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint, F
     tmp_done = 1;
     double pct_bitlen = gwstate.N->bitlen()/1000.0;
     double last_progress = 0;
+    double time_product = 0;
+    double time_gcd = 0;
+    double time_gcd_wait = 0;
     auto progress_factors = [&]() {
         if (logging.level() <= Logging::LEVEL_PROGRESS)
         {
@@ -497,7 +562,8 @@ void MorrisonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint, F
             break;
         }
 
-        uint32_t fingerprint = File::unique_fingerprint(_fingerprint, std::to_string(_P));
+        // Stack files are not compatible between tree layouts, ".h" marks the cost-balanced one.
+        uint32_t fingerprint = File::unique_fingerprint(_fingerprint, std::to_string(_P) + ".h");
         double last_write = 0;
         std::vector<FactorTree*> stack;
         std::vector<LucasVMulFast::State> stack_value;
@@ -505,6 +571,28 @@ void MorrisonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint, F
         std::vector<int> factors;
         std::string factors_str;
         std::vector<Giant> G;
+        GcdThread gcd(gwstate.thread_count);
+        std::vector<int> gcd_factors;
+        auto gcd_wait = [&]() {
+            if (!gcd.running())
+                return false;
+            Giant& g = gcd.wait();
+            time_gcd += gcd.timer();
+            time_gcd_wait += gcd.timer_wait();
+            logging.debug("Gcd %.3f s, waited %.3f s.\n", gcd.timer(), gcd.timer_wait());
+            if (g != 1)
+            {
+                _factor = std::move(g);
+                return true;
+            }
+            for (auto it = gcd_factors.begin(); it != gcd_factors.end(); it++)
+            {
+                logging.progress().param("factors") += "," + std::to_string(*it);
+                _done_factors.insert(*it);
+            }
+            gcd_factors.clear();
+            return false;
+        };
         auto test_G = [&]() {
             if (!G.empty())
             {
@@ -512,7 +600,11 @@ void MorrisonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint, F
                 {
                     bool a = Task::abort_flag();
                     Task::abort_reset();
+                    auto start = std::chrono::system_clock::now();
                     tmp = Pr.mul(G.begin(), G.end());
+                    double time = std::chrono::duration<double>(std::chrono::system_clock::now() - start).count();
+                    time_product += time;
+                    logging.debug("Product of %d residues %.3f s.\n", (int)G.size(), time);
                     if (a)
                         Task::abort();
                 }
@@ -526,19 +618,21 @@ void MorrisonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint, F
                 G.clear();
                 factors_str.clear();
 
-                tmp.gcd(*gwstate.N);
-                if (tmp != 1)
-                {
-                    _factor = std::move(tmp);
+                // The gcd runs while the walk continues, its factors are marked done by the next call to gcd_wait().
+                if (gcd_wait())
                     return true;
-                }
-            }
-
-            for (auto it = factors.begin(); it != factors.end(); it++)
-            {
-                logging.progress().param("factors") += "," + std::to_string(*it);
-                _done_factors.insert(*it);
+                gcd.start(std::move(tmp), *gwstate.N);
             }
+            else if (gcd_wait())
+                return true;
+            if (gcd.running())
+                gcd_factors.insert(gcd_factors.end(), factors.begin(), factors.end());
+            else
+                for (auto it = factors.begin(); it != factors.end(); it++)
+                {
+                    logging.progress().param("factors") += "," + std::to_string(*it);
+                    _done_factors.insert(*it);
+                }
             factors.clear();
 
             if (tmp_done != 1)
@@ -548,6 +642,8 @@ void MorrisonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint, F
             if ((!(_options.AllFactors && _options.AllFactors.value()) || stack.empty()) && (_done.bitlen()*2 + 10 > gwstate.N->bitlen() &&
                 (_done.bitlen()*2 > gwstate.N->bitlen() + 10 || square(_done) > *gwstate.N)))
             {
+                if (gcd_wait())
+                    return true;
                 _prime = true;
                 return true;
             }
@@ -555,9 +651,9 @@ void MorrisonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint, F
         };
         std::string stack_file_prefix = std::to_string(_P) + ".s";
         auto write_values = [&]() {
-            if (!G.empty())
+            if (!G.empty() || gcd.running())
             {
-                if (test_G())
+                if (test_G() || gcd_wait())
                     return true;
                 logging.progress_save();
             }
@@ -704,6 +800,8 @@ void MorrisonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint, F
                 if (!stack_value.empty())
                     stack_value.back().V() = std::move(cur_task->P());
                 stack_value.emplace_back(0, task_num, std::move(*cur_task->result()), cur_task->negativeQ() && cur_task->result_parity());
+                if (stack.back()->cost() > 0)
+                    logging.debug("Stage %d: predicted cost %.0f, %.3f s.\n", task_num, stack.back()->cost(), cur_task->timer());
                 last_progress += cur_task->timer();
                 last_write += cur_task->timer();
                 _logging->progress().next_stage();
@@ -797,9 +895,9 @@ void MorrisonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint, F
             }
         }
 
-        if (!stack.empty())
+        if (gcd_wait() || !stack.empty())
             break;
-        if (test_G())
+        if (test_G() || gcd_wait())
             break;
 
         for (_P++; kronecker(_P*_P - (_negQ ? -4 : 4), *gwstate.N) == 1; _P++);
@@ -821,6 +919,8 @@ void MorrisonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint, F
     logging.progress().next_stage();
     if (_prime)
         logging.info("%.1f%% of factors tested.\n", std::floor(_done.bitlen()/pct_bitlen)/10.0);
+    if (time_gcd > 0)
+        logging.info("Products %.1f s, gcds %.1f s of which %.1f s not overlapped with the walk.\n", time_product, time_gcd, time_gcd_wait);
     logging.set_prefix("");
     if (!_res64.empty())
         result_not_probable_prime_res64(input, logging, _res64, logging.progress().time_total());
@@ -15,33 +15,53 @@ public:
     Morrison(InputNum& input, Options& options, Logging& logging);
     virtual ~Morrison() { }
 
+    // Predicted cost in multiplications modulo N.
+    static double cost(InputNum& input, Options& options);
+
     void run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging) override;
 
-protected:
-    class FactorTask
-    {
-    public:
-        FactorTask(int i) : index(i) { }
-        int index;
-        std::unique_ptr<LucasVMulFast> taskFactor;
-        std::unique_ptr<LucasVMulFast> taskCheck;
-    };
+    int P() { return _P; }
+    bool negativeQ() { return _negQ; }
 
 protected:
     std::unique_ptr<LucasVMul> _task;
     std::unique_ptr<LucasVMulFast> _taskCheck;
-    std::vector<FactorTask> _factor_tasks;
+    // Indices of factors tested by the gcd.
+    std::vector<int> _factor_tasks;
+    std::unique_ptr<FactorTree> _tree;
     int _P;
     bool _negQ;
 };
 
+// Runs a Fermat test first and the Lucas test only on probable primes.
+// Most candidates of a batch are composite, and the Fermat test costs half of the Lucas test.
+class Triage : public Run
+{
+public:
+    Triage(Fermat* prp, Run* run, InputNum& input, Options& options);
+    virtual ~Triage() { }
+
+    void run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging) override;
+
+    Run* test() { return _run.get(); }
+
+protected:
+    std::unique_ptr<Fermat> _prp;
+    std::unique_ptr<Run> _run;
+};
+
 class MorrisonGeneric : public Run
 {
 public:
     MorrisonGeneric(InputNum& input, Options& options, Logging& logging);
 
+    // Predicted cost in multiplications modulo N.
+    static double cost(InputNum& input, Options& options);
+
     void run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging) override;
 
+    bool negativeQ() { return _negQ; }
+
 protected:
     std::unique_ptr<SubLogging> _logging;
     arithmetic::Giant _done;
@@ -560,7 +560,7 @@ int net_main(int argc, char *argv[])
         File* file_recoverypoint = newFile("recoverypoint", fingerprint);
 
         GWState gwstate;
-        options.configure(gwstate);
+        options.configure(gwstate, input);
         if (net.task()->options.find("FFT_Increment") != net.task()->options.end())
             gwstate.next_fft_count = std::stoi(net.task()->options["FFT_Increment"]);
         if (net.task()->options.find("FFT_Safety") != net.task()->options.end())
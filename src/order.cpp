@@ -7,19 +7,20 @@
 #include "integer.h"
 
 #include "order.h"
+#include "pocklington.h"
 
 using namespace arithmetic;
 
-Order::Order(InputNum& input, Options& options, Logging& logging) : Run("Order", input, options)
+Order::Order(InputNum& input, Options& options, Logging& logging, InputNum& a) : Run("Order", input, options), _a(&a)
 {
     _factors = input.factors();
-    Giant ga = options.OrderA->value();
+    Giant ga = a.value();
     create_tasks(ga, logging, false);
 
     if (_task && ga <= GWMULBYCONST_MAX)
         logging.report_param("maxmulbyconst", (int)ga.data()[0]);
 
-    _fingerprint = File::unique_fingerprint(input.fingerprint(), std::to_string(options.OrderA->fingerprint()));
+    _fingerprint = File::unique_fingerprint(input.fingerprint(), std::to_string(a.fingerprint()));
 }
 
 MultipointExp* Order::create_smooth_task(arithmetic::Giant& base, int power)
@@ -103,18 +104,11 @@ void Order::create_tasks(Giant& a, Logging& logging, bool restart)
         logging.progress().add_stage(task_smooth->cost());
 
     _tasks.clear();
-    exp = 1;
     for (auto& factor : _factors)
     {
         int n = (factor.second <= _sub ? factor.second : _sub);
-        exp *= power(factor.first, n);
         _tasks.emplace_back(factor.first, factor.second - n, n);
-    }
-    _task_check.reset(new CarefulExp(exp));
-    for (auto& factor : _tasks)
-    {
-        factor.task_sub.reset(new CarefulExp(exp/power(factor.b, factor.n)));
-        factor.task_factor.reset(new CarefulExp(factor.b));
+        _tasks.back().task_factor.reset(new CarefulExp(factor.first, false));
     }
 }
 
@@ -130,11 +124,11 @@ bool Order::on_point(int index, BaseExp::State* state)
 
 void Order::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging)
 {
-    Giant ga = _options.OrderA->value();
-    logging.info("Computing multiplicative order of %s modulo prime %s.\n", _options.OrderA->display_text().data(), input.display_text().data());
+    Giant ga = _a->value();
+    logging.info("Computing multiplicative order of %s modulo prime %s.\n", _a->display_text().data(), input.display_text().data());
     if (gwstate.information_only)
         throw TaskAbortException();
-    logging.set_prefix("ord(" + _options.OrderA->display_text() + ") mod " + input.display_text() + " ");
+    logging.set_prefix("ord(" + _a->display_text() + ") mod " + input.display_text() + " ");
 
     while (!_factors.empty())
     {
@@ -209,27 +203,76 @@ void Order::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_
 
         logging.info("computing order for each factor.\n");
 
-        _task_check->init_giant(&input, &gwstate, &logging, std::move(sub_val));
-        _task_check->run();
-        sub_val = std::move(_task_check->X0());
-        if (*_task_check->result() != 1)
+        // The walk raises sub_val to E/q^n for each factor q^n of E = prod q^n, sharing the common exponents,
+        // and checks that the results raised to q^n are 1.
+        std::vector<std::unique_ptr<FactorTree>> leaves;
+        for (int i = 0; i < _tasks.size(); i++)
+            leaves.emplace_back(new FactorTree(power(_tasks[i].b, _tasks[i].n), i));
+        FactorTree tree(leaves);
+
+        std::vector<Giant> vals(_tasks.size());
+        bool carefully = false;
+        bool error = false;
+        FactorWalk<Giant> walk([&](Giant& X, Giant& exp)
+            {
+                CarefulExp task(exp, carefully);
+                task.init_giant(&input, &gwstate, &logging, std::move(X));
+                task.run();
+                X = std::move(*task.result());
+            },
+            [&](int index, Giant& X, Giant& check)
+            {
+                if (check != 1)
+                {
+                    error = true;
+                    return false;
+                }
+                vals[index] = std::move(X);
+                return true;
+            });
+        while (true)
+        {
+            error = false;
+            Giant X;
+            X = sub_val;
+            walk.run(&tree, X);
+            if (!error || carefully)
+                break;
+            logging.warning("Arithmetic error, repeating carefully.\n");
+            carefully = true;
+        }
+        if (error)
         {
             logging.set_prefix("");
             logging.error("%s is not prime.\n", input.display_text().data());
             throw TaskAbortException();
         }
 
-        for (auto& factor : _tasks)
+        for (int i = 0; i < _tasks.size(); i++)
         {
+            auto& factor = _tasks[i];
             auto it = _factors.begin();
             for (; it != _factors.end() && it->first != factor.b; it++);
 
-            factor.task_sub->init_giant(&input, &gwstate, &logging, std::move(sub_val));
-            factor.task_sub->run();
-            sub_val = std::move(factor.task_sub->X0());
+            Giant cur_val;
+            int ord;
+            while (true)
+            {
+                cur_val = vals[i];
+                ord = factor.ord;
+                for (int j = 0; j < factor.n && cur_val != 1; j++, ord++)
+                {
+                    factor.task_factor->init_giant(&input, &gwstate, &logging, std::move(cur_val));
+                    factor.task_factor->run();
+                    cur_val = std::move(*factor.task_factor->result());
+                }
+                if (cur_val == 1 || factor.task_factor->carefully())
+                    break;
+                logging.warning("Arithmetic error, repeating carefully.\n");
+                factor.task_factor->set_carefully(true);
+            }
 
-            Giant cur_val = std::move(*factor.task_sub->result());
-            if (cur_val == 1)
+            if (ord == factor.ord)
             {
                 if (it->second <= _sub)
                     _factors.erase(it);
@@ -238,14 +281,6 @@ void Order::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_
                 continue;
             }
 
-            int ord = factor.ord;
-            for (int i = 0; i < factor.n && cur_val != 1; i++, ord++)
-            {
-                factor.task_factor->init_giant(&input, &gwstate, &logging, std::move(cur_val));
-                factor.task_factor->run();
-                cur_val = std::move(*factor.task_factor->result());
-            }
-
             if (cur_val != 1)
             {
                 logging.set_prefix("");
@@ -293,13 +328,44 @@ void Order::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_
     }
 
     logging.set_prefix("");
-    logging.result(true, "ord(%s) mod %s = %s.\n", _options.OrderA->display_text().data(), input.display_text().data(), _result.data());
-    logging.result_save("ord(" + _options.OrderA->display_text() + ") mod " + input.input_text() + " = " + _result + ".\n");
+    logging.result(true, "ord(%s) mod %s = %s.\n", _a->display_text().data(), input.display_text().data(), _result.data());
+    logging.result_save("ord(" + _a->display_text() + ") mod " + input.input_text() + " = " + _result + ".\n");
 
     file_checkpoint.clear(true);
     file_recoverypoint.clear(true);
 }
 
+MultiOrder::MultiOrder(InputNum& input, Options& options, Logging& logging) : Run("MultiOrder", input, options)
+{
+    int maxmulbyconst = 1;
+    for (auto& a : options.OrderA)
+        if (a->value() <= GWMULBYCONST_MAX && (int)a->value().data()[0] > maxmulbyconst)
+            maxmulbyconst = a->value().data()[0];
+    logging.report_param("maxmulbyconst", maxmulbyconst);
+
+    _fingerprint = File::unique_fingerprint(input.fingerprint(), std::to_string(options.order_fingerprint()));
+}
+
+void MultiOrder::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging)
+{
+    logging.info("Computing multiplicative orders of %d bases modulo prime %s.\n", (int)_options.OrderA.size(), input.display_text().data());
+    if (gwstate.information_only)
+        throw TaskAbortException();
+
+    // Bases done in a previous session have already reported their results.
+    for (int i = logging.progress().param_int("bases"); i < _options.OrderA.size(); i++)
+    {
+        // Order adds its stages when constructed, so each base is set up right before it runs.
+        Order order(input, _options, logging, *_options.OrderA[i]);
+        order.run(gwstate, file_checkpoint, file_recoverypoint, logging);
+        if (!_result.empty())
+            _result += ", ";
+        _result += order.result();
+        logging.report_param("bases", i + 1);
+        logging.progress_save();
+    }
+}
+
 FermatDivisor::FermatDivisor(InputNum& input, Options& options, Logging& logging) : Order("FermatDivisor", input, options)
 {
     GWASSERT(input.factors()[0].first == 2);
@@ -462,6 +528,13 @@ void FermatDivisor::run(arithmetic::GWState& gwstate, File& file_checkpoint, Fil
             if (ord < input.factors()[0].second - 15)
                 logging.warning("GF(%d,%d)\n", ord, b);
         }
+
+        // Composite bases are built from bases up to limit/2, xGF pairs need all of them.
+        if (_options.Divides != "xGF" && b > limit/2)
+        {
+            base.val.arithmetic().free(base.val);
+            base.sub_val.arithmetic().free(base.sub_val);
+        }
     }
 
     if (_options.Divides == "xGF")
@@ -10,7 +10,7 @@
 class Order : public Run
 {
 public:
-    Order(InputNum& input, Options& options, Logging& logging);
+    Order(InputNum& input, Options& options, Logging& logging, InputNum& a);
 
     void run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging) override;
 
@@ -27,11 +27,11 @@ protected:
         arithmetic::Giant b;
         int ord;
         int n;
-        std::unique_ptr<CarefulExp> task_sub;
         std::unique_ptr<CarefulExp> task_factor;
     };
 
 protected:
+    InputNum* _a = nullptr;
     int _sub = 30;
     std::vector<std::pair<arithmetic::Giant, int>> _factors;
     std::vector<std::pair<arithmetic::Giant, int>> _order;
@@ -44,6 +44,16 @@ protected:
     int _task_break;
 };
 
+// Orders of several bases modulo the same prime. The input, its factors and GWState are set up once,
+// each base then runs its own Order with the factor descent and reports its own result line.
+class MultiOrder : public Run
+{
+public:
+    MultiOrder(InputNum& input, Options& options, Logging& logging);
+
+    void run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging) override;
+};
+
 class FermatDivisor : public Order
 {
 public:
@@ -2,6 +2,7 @@
 #include <algorithm>
 #include <set>
 #include <cmath>
+#include <chrono>
 #include <string.h>
 
 #include "gwnum.h"
@@ -24,26 +25,31 @@ Pocklington::Pocklington(InputNum& input, Options& options, Logging& logging, Pr
         _a = logging.progress().param_int("a");
         logging.report_param("maxmulbyconst", _a);
     }
-    _fingerprint = input.fingerprint();
+    _fingerprint = _smooth ? File::unique_fingerprint(input.fingerprint(), "smooth") : input.fingerprint();
 
     _done = 1;
     _tasks.reserve(input.factors().size());
     for (int i = 0; i < input.factors().size(); i++)
         if (logging.progress().param("factor" + std::to_string(i)).empty())
-        {
-            _tasks.emplace_back(i);
-            Giant& factor = input.factors()[i].first;
-            Giant tmp = _task_fermat_simple->exp()/factor;
-            if (tmp != 1)
-            {
-                _tasks.back().taskFactor.reset(new CarefulExp(std::move(tmp)));
-                _tasks.back().taskCheck.reset(new CarefulExp(factor));
-            }
-        }
+            _tasks.push_back(i);
         else
             _done *= power(input.factors()[i].first, input.factors()[i].second);
 }
 
+double Pocklington::cost(InputNum& input, Options& options)
+{
+    std::vector<double> costs;
+    double factors = 0;
+    for (auto& f : input.factors())
+        if (f.first != 2)
+        {
+            costs.push_back(f.first.bitlen());
+            factors += f.first.bitlen();
+        }
+    // The walk of the factor tree raises the result of the Fermat stage to the product of the other factors for each factor, then checks it.
+    return Fermat::cost(input, options, Fermat::smooth(input, options)) + FactorTree::walk_cost(costs) + factors + costs.size() + Run::gcd_cost(input);
+}
+
 void Pocklington::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging, Proof* proof)
 {
     if (type() != POCKLINGTON || !_factor.empty())
@@ -70,38 +76,76 @@ void Pocklington::run(arithmetic::GWState& gwstate, File& file_checkpoint, File&
         std::vector<int> factors;
         std::string factors_str;
 
-        for (auto it = _tasks.begin(); it != _tasks.end(); )
+        if (_tasks.size() == 1 && _task_fermat_simple->exp() == input.factors()[_tasks[0]].first)
         {
-            if (it->taskFactor)
-            {
-                it->taskFactor->init_giant(&input, &gwstate, &logging, std::move(*_task->result()));
-                it->taskFactor->run();
-                *_task->result() = std::move(it->taskFactor->X0());
-                tmp = std::move(*it->taskFactor->result());
-
-                it->taskCheck->init_giant(&input, &gwstate, &logging, std::move(tmp));
-                it->taskCheck->run();
-                if (*it->taskCheck->result() != 1)
-                {
-                    logging.warning("Arithmetic error, restarting.");
-                    continue;
-                }
-                tmp = std::move(it->taskCheck->X0());
-            }
-            else
-                tmp = *_task->result();
+            tmp = *_task->result();
             if (tmp != 1)
             {
-                tmp -= 1;
                 G.emplace_back(std::move(tmp));
-                _done *= power(input.factors()[it->index].first, input.factors()[it->index].second);
-                factors.push_back(it->index);
-                factors_str += (!factors_str.empty() ? ", " : "") + input.factors()[it->index].first.to_string();
-                it = _tasks.erase(it);
+                factors.push_back(_tasks[0]);
             }
-            else
-                it++;
         }
+        else
+        {
+            // The root raises the result to the factors tested already.
+            std::vector<std::unique_ptr<FactorTree>> leaves;
+            tmp = 1;
+            for (auto i : _tasks)
+            {
+                leaves.emplace_back(new FactorTree(input.factors()[i].first, i));
+                tmp *= input.factors()[i].first;
+            }
+            FactorTree tree(leaves);
+            tree.exp() = _task_fermat_simple->exp()/tmp;
+
+            bool carefully = false;
+            bool error = false;
+            FactorWalk<Giant> walk([&](Giant& X, Giant& exp)
+                {
+                    CarefulExp task(exp, carefully);
+                    task.init_giant(&input, &gwstate, &logging, std::move(X));
+                    task.run();
+                    X = std::move(*task.result());
+                },
+                [&](int index, Giant& X, Giant& check)
+                {
+                    if (check != 1)
+                    {
+                        error = true;
+                        return false;
+                    }
+                    if (X != 1)
+                    {
+                        G.emplace_back(std::move(X));
+                        factors.push_back(index);
+                    }
+                    return true;
+                });
+            while (true)
+            {
+                G.clear();
+                factors.clear();
+                error = false;
+                tmp = *_task->result();
+                walk.run(&tree, tmp);
+                if (!error)
+                    break;
+                if (!carefully)
+                    logging.warning("Arithmetic error, repeating carefully.\n");
+                else
+                    logging.warning("Arithmetic error, restarting.\n");
+                carefully = true;
+            }
+        }
+
+        for (auto i : factors)
+        {
+            _done *= power(input.factors()[i].first, input.factors()[i].second);
+            factors_str += (!factors_str.empty() ? ", " : "") + input.factors()[i].first.to_string();
+            _tasks.erase(std::find(_tasks.begin(), _tasks.end(), i));
+        }
+        for (auto& g : G)
+            g -= 1;
 
         if (G.size() > 0)
         {
@@ -153,6 +197,8 @@ void Pocklington::run(arithmetic::GWState& gwstate, File& file_checkpoint, File&
 
             sa = std::to_string(_a);
             logging.report_param("a", sa);
+            if (_task_ak)
+                logging.progress().add_stage(_task_ak->cost());
             logging.progress().add_stage(_task->cost());
             logging.progress().update(0, 0);
             logging.progress_save();
@@ -181,8 +227,11 @@ PocklingtonGeneric::PocklingtonGeneric(InputNum& input, Options& options, Loggin
     else
         _a = options.FermatBase ? options.FermatBase.value() : 3;
     logging.report_param("maxmulbyconst", (_a > GWMULBYCONST_MAX ? 1 : _a));
-    _fingerprint = input.fingerprint();
+    // Pocklington test of the same input checkpoints other values.
+    _fingerprint = File::unique_fingerprint(input.fingerprint(), "generic");
 
+    // Factors tested before the tree was built are listed first, the tree of an interrupted walk has to be rebuilt without the rest.
+    int tree_factors = logging.progress().param("tree").empty() ? -1 : logging.progress().param_int("tree");
     std::string& st = logging.progress().param("factors");
     for (std::string::const_iterator it = st.begin(), it_p = st.begin(); it != st.end(); )
     {
@@ -190,55 +239,34 @@ PocklingtonGeneric::PocklingtonGeneric(InputNum& input, Options& options, Loggin
             it++;
         char* str_end;
         if (it != it_p)
-            _done_factors.insert((int)std::strtol(&*it_p, &str_end, 10));
+        {
+            int index = (int)std::strtol(&*it_p, &str_end, 10);
+            _done_factors.insert(index);
+            if (tree_factors < 0 || (int)_tree_factors.size() < tree_factors)
+                _tree_factors.insert(index);
+        }
         if (it != st.end())
             it++;
         it_p = it;
     }
+    logging.report_param("tree", (int)_tree_factors.size());
 
-    Giant tmp;
-    Giant exp;
-    if (input.cofactor().empty())
-        exp = 1;
-    else
-        exp = input.cofactor();
-    _done = 1;
-    Giant tmp_exp;
-    tmp_exp = 1;
-    Giant tmp_done;
-    tmp_done = 1;
-
+    std::vector<Giant> exp_values;
+    std::vector<Giant> done_values;
+    if (!input.cofactor().empty())
+        exp_values.emplace_back() = input.cofactor();
     for (int i = 0; i < input.factors().size(); i++)
     {
         auto& f = input.factors()[i];
         if (_done_factors.count(i) != 0)
-        {
-            tmp = f.first;
-            tmp.power(f.second);
-            tmp_done *= tmp;
-            tmp_exp *= tmp;
-        }
+            done_values.emplace_back(power(f.first, f.second));
+        if (_tree_factors.count(i) != 0)
+            exp_values.emplace_back(power(f.first, f.second));
         else if (f.second > 1)
-        {
-            tmp = f.first;
-            tmp.power(f.second - 1);
-            tmp_exp *= tmp;
-        }
-        if (tmp_done.size() > 8192)
-        {
-            _done *= tmp_done;
-            tmp_done = 1;
-        }
-        if (tmp_exp.size() > 8192)
-        {
-            exp *= tmp_exp;
-            tmp_exp = 1;
-        }
+            exp_values.emplace_back(power(f.first, f.second - 1));
     }
-    if (tmp_done != 1)
-        _done *= tmp_done;
-    if (tmp_exp != 1)
-        exp *= tmp_exp;
+    _done = product_tree(done_values, options.thread_count);
+    Giant exp = product_tree(exp_values, options.thread_count);
 
     _logging.reset(new SubLogging(logging, logging.level() + 1));
     _logging->progress().set_parent(nullptr);
@@ -247,18 +275,42 @@ PocklingtonGeneric::PocklingtonGeneric(InputNum& input, Options& options, Loggin
     create_tasks(input, logging, exp);
 }
 
+double PocklingtonGeneric::cost(InputNum& input, Options& options)
+{
+    bool CheckStrong = options.CheckStrong ? options.CheckStrong.value() : true;
+    std::vector<double> costs;
+    double factors = 0;
+    for (auto& f : input.factors())
+    {
+        costs.push_back(f.first.bitlen());
+        factors += costs.back();
+    }
+    // The root raises a to N-1 without one copy of each factor.
+    double root = input.bitlen() - factors;
+    if (CheckStrong && root > 1)
+    {
+        Giant exp;
+        exp = 1;
+        exp <<= (int)root;
+        FastLiCheckExp task(std::move(exp), options.StrongCount ? options.StrongCount.value() : 16, options.StrongL ? options.StrongL.value() : 0);
+        root = task.cost();
+    }
+    // Residues are multiplied in batches of 100 per gcd.
+    return root + FactorTree::walk_cost(costs) + costs.size() + ((costs.size() + 99)/100)*Run::gcd_cost(input);
+}
+
 void PocklingtonGeneric::create_tasks(InputNum& input, Logging& logging, arithmetic::Giant& exp)
 {
     //_logging.reset(new SubLogging(logging, logging.level() + 1));
 
     std::vector<std::unique_ptr<FactorTree>> factors;
     int i = 0;
-    auto it = _done_factors.begin();
-    for (; i < input.factors().size() && it != _done_factors.end() && *it == i; it++, i++);
+    auto it = _tree_factors.begin();
+    for (; i < input.factors().size() && it != _tree_factors.end() && *it == i; it++, i++);
     while (i < input.factors().size())
     {
         factors.emplace_back(new FactorTree(input.factors()[i].first, i));
-        for (i++; i < input.factors().size() && it != _done_factors.end() && *it == i; it++, i++);
+        for (i++; i < input.factors().size() && it != _tree_factors.end() && *it == i; it++, i++);
     }
 
     _tree.reset(new FactorTree(factors));
@@ -335,6 +387,9 @@ void PocklingtonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint
     tmp_done = 1;
     double pct_bitlen = gwstate.N->bitlen()/1000.0;
     double last_progress = 0;
+    double time_product = 0;
+    double time_gcd = 0;
+    double time_gcd_wait = 0;
     auto progress_factors = [&]() {
         if (logging.level() <= Logging::LEVEL_PROGRESS)
         {
@@ -360,45 +415,99 @@ void PocklingtonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint
         tmp_exp = 1;
         Giant exp;
         exp = 1;
+        GWNumPool pool;
         std::vector<FactorTree*> stack;
         std::vector<Giant> stack_value;
+        // Values of nodes without checkpoints stay in FFT form until a Giant is needed.
+        std::vector<std::unique_ptr<GWNum>> stack_fft;
+        // Task numbers of the values and whether they are saved in the stack files.
+        std::vector<int> stack_task;
+        std::vector<bool> stack_written;
+        auto value_giant = [&]() -> Giant& {
+            if (stack_fft.back())
+            {
+                stack_value.back() = *stack_fft.back();
+                if (gwstate.need_mod())
+                    gwstate.mod(stack_value.back(), stack_value.back());
+                pool.free(stack_fft.back());
+            }
+            return stack_value.back();
+        };
+        auto value_push = [&](int task) {
+            stack_value.emplace_back();
+            stack_fft.emplace_back();
+            stack_task.push_back(task);
+            stack_written.push_back(false);
+        };
+        auto value_pop = [&]() {
+            if (stack_fft.back())
+                pool.free(stack_fft.back());
+            stack_fft.pop_back();
+            stack_value.pop_back();
+            stack_task.pop_back();
+            stack_written.pop_back();
+        };
         int task_num = 0;
         std::vector<int> factors;
         std::string factors_str;
         std::vector<Giant> G;
-        auto test_G = [&]() {
-            if (G.size() > 1)
+        GcdThread gcd(gwstate.thread_count);
+        std::vector<int> gcd_factors;
+        auto gcd_wait = [&]() {
+            if (!gcd.running())
+                return false;
+            Giant& g = gcd.wait();
+            time_gcd += gcd.timer();
+            time_gcd_wait += gcd.timer_wait();
+            logging.debug("Gcd %.3f s, waited %.3f s.\n", gcd.timer(), gcd.timer_wait());
+            if (g != 1)
             {
-                bool a = Task::abort_flag();
-                Task::abort_reset();
-                tmp = Pr.mul(G.begin(), G.end());
-                if (a)
-                    Task::abort();
-            }
-            else
-                tmp = std::move(G[0]);
-
-            if (factors_str.size() < 50)
-                logging.debug("Checking gcd with factors {%s}.\n", factors_str.data());
-            else
-                logging.debug("Checking gcd with %d factors.\n", G.size());
-            G.clear();
-            factors_str.clear();
-
-            tmp.gcd(*gwstate.N);
-            if (tmp != 1)
-            {
-                _factor = std::move(tmp);
+                _factor = std::move(g);
                 return true;
             }
-
-            for (auto it = factors.begin(); it != factors.end(); it++)
+            for (auto it = gcd_factors.begin(); it != gcd_factors.end(); it++)
             {
                 logging.progress().param("factors") += "," + std::to_string(*it);
                 GWASSERT(_done_factors.count(*it) == 0);
                 _done_factors.insert(*it);
             }
-            factors.clear();
+            gcd_factors.clear();
+            return false;
+        };
+        auto test_G = [&]() {
+            if (!G.empty())
+            {
+                if (G.size() > 1)
+                {
+                    bool a = Task::abort_flag();
+                    Task::abort_reset();
+                    auto start = std::chrono::system_clock::now();
+                    tmp = Pr.mul(G.begin(), G.end());
+                    double time = std::chrono::duration<double>(std::chrono::system_clock::now() - start).count();
+                    time_product += time;
+                    logging.debug("Product of %d residues %.3f s.\n", (int)G.size(), time);
+                    if (a)
+                        Task::abort();
+                }
+                else
+                    tmp = std::move(G[0]);
+
+                if (factors_str.size() < 50)
+                    logging.debug("Checking gcd with factors {%s}.\n", factors_str.data());
+                else
+                    logging.debug("Checking gcd with %d factors.\n", G.size());
+                G.clear();
+                factors_str.clear();
+
+                // The gcd runs while the walk continues, its factors are marked done by the next call to gcd_wait().
+                if (gcd_wait())
+                    return true;
+                gcd_factors = std::move(factors);
+                factors.clear();
+                gcd.start(std::move(tmp), *gwstate.N);
+            }
+            else if (gcd_wait())
+                return true;
 
             if (tmp_done != 1)
                 _done *= tmp_done;
@@ -407,23 +516,124 @@ void PocklingtonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint
                 exp *= tmp_exp;
             tmp_exp = 1;
 
-            if (_done_factors.size() == input.factors().size())
+            if (_done_factors.size() + gcd_factors.size() == input.factors().size())
                 GWASSERT((input.cofactor().empty() ? _done : _done*input.cofactor()) == input.value() - 1);
-            if (_done_factors.size() == input.factors().size() || (!(_options.AllFactors && _options.AllFactors.value()) && _done.bitlen()*2 + 10 > gwstate.N->bitlen() &&
+            if (_done_factors.size() + gcd_factors.size() == input.factors().size() || (!(_options.AllFactors && _options.AllFactors.value()) && _done.bitlen()*2 + 10 > gwstate.N->bitlen() &&
                 (_done.bitlen()*2 > gwstate.N->bitlen() + 10 || square(_done) > *gwstate.N)))
             {
-                _prime = true;
+                if (!gcd_wait())
+                    _prime = true;
                 return true;
             }
             return false;
         };
 
+        // The tree depends on a and on the factors left out of it.
+        uint32_t fingerprint = File::unique_fingerprint(_fingerprint, std::to_string(_a) + "." + std::to_string(_tree_factors.size()));
+        std::string stack_file_prefix = std::to_string(_a) + ".s";
+        double last_write = 0;
+        int values_base = 0;
+        auto write_values = [&]() {
+            if (!G.empty() || gcd.running())
+            {
+                if (test_G() || gcd_wait())
+                    return true;
+                logging.progress_save();
+            }
+            logging.debug("saving state to disk.\n");
+            int count = (int)stack_value.size() - values_base;
+            int i;
+            for (i = 0; true; i++)
+            {
+                if (i < count && stack_written[values_base + i])
+                    continue;
+                std::string filename = file_checkpoint.filename() + "." + stack_file_prefix + std::to_string(i);
+                auto it = file_checkpoint.children().begin();
+                for (; it != file_checkpoint.children().end() && (*it)->filename() != filename; it++);
+                if (it == file_checkpoint.children().end())
+                {
+                    if (i < count)
+                        continue;
+                    else if (i == count)
+                    {
+                        file_checkpoint.add_child(stack_file_prefix + std::to_string(i), fingerprint);
+                        it = file_checkpoint.children().end() - 1;
+                    }
+                    else
+                        break;
+                }
+                (*it)->clear();
+                file_checkpoint.children().erase(it);
+            }
+            for (i = values_base; i < stack_value.size(); i++)
+            {
+                if (stack_written[i])
+                    continue;
+                if (stack_fft[i])
+                {
+                    stack_value[i] = *stack_fft[i];
+                    if (gwstate.need_mod())
+                        gwstate.mod(stack_value[i], stack_value[i]);
+                    pool.free(stack_fft[i]);
+                }
+                File* checkpoint = file_checkpoint.add_child(stack_file_prefix + std::to_string(i - values_base), fingerprint);
+                BaseExp::StateValue state(stack_task[i], stack_value[i]);
+                checkpoint->write(state);
+                stack_written[i] = true;
+            }
+            last_write = 0;
+            return false;
+        };
+
         stack.push_back(_tree.get());
         if (_a > GWMULBYCONST_MAX)
         {
-            stack_value.emplace_back();
+            value_push(0);
             stack_value.back() = _a;
+            values_base = 1;
+        }
+        if (stack.back()->exp() == 1)
+            task_num = 1;
+        for (int i = 0; true; i++)
+        {
+            File* checkpoint = file_checkpoint.add_child(stack_file_prefix + std::to_string(i), fingerprint);
+            BaseExp::StateValue state;
+            if (!checkpoint->read(state))
+            {
+                file_checkpoint.children().pop_back();
+                break;
+            }
+            if (task_num > 0)
+            {
+                if (state.iteration() == task_num + 1)
+                    stack.push_back(stack.back()->left());
+                else
+                {
+                    stack.back()->left()->exp().arithmetic().free(stack.back()->left()->exp());
+                    stack.push_back(stack.back()->right());
+                }
+                stack.back()->exp().arithmetic().free(stack.back()->exp());
+            }
+            else
+            {
+                exp = stack.back()->exp();
+                stack.back()->exp().arithmetic().free(stack.back()->exp());
+            }
+            value_push(state.iteration());
+            stack_value.back() = std::move(state.value());
+            stack_written.back() = true;
+            task_num = state.iteration();
         }
+        if (task_num > 0 && stack_value.size() > values_base)
+        {
+            logging.info("Resuming the walk at stage %d.\n", task_num);
+            stack.push_back(stack.back()->left());
+        }
+        // Factors tested after the tree was built are skipped by the walk.
+        for (auto it = _done_factors.begin(); it != _done_factors.end(); it++)
+            if (_tree_factors.count(*it) == 0)
+                tmp_exp *= input.factors()[*it].first;
+
         while (!stack.empty())
         {
             if (!stack.back()->exp().empty() && stack.back()->exp() != 1)
@@ -453,6 +663,7 @@ void PocklingtonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint
                         cur_task.reset(new SlidingWindowExp(std::move(stack.back()->exp())));
                 }
                 stack.back()->exp().arithmetic().free(stack.back()->exp());
+                cur_task->set_pool(&pool);
                 cur_task->set_error_check(!_options.CheckNear || _options.CheckNear.value(), _options.Check && _options.Check.value());
                 _logging->progress() = Progress();
                 _logging->progress().add_stage(cur_task->cost());
@@ -463,10 +674,23 @@ void PocklingtonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint
                 if (stack.size() == 1 || (stack.size() == 2 && stack[0]->exp() == 1))
                 {
                     std::string file_num = std::to_string(_a) + "." + _done.to_res64() + "." + std::to_string(_done.bitlen());
-                    checkpoint = file_checkpoint.add_child(file_num, File::unique_fingerprint(_fingerprint, file_num));
-                    recoverypoint = file_recoverypoint.add_child(file_num, File::unique_fingerprint(_fingerprint, file_num));
+                    // The exponent of the node depends on the tree layout.
+                    std::string salt = file_num + "." + cur_task->exp().to_res64();
+                    checkpoint = file_checkpoint.add_child(file_num, File::unique_fingerprint(_fingerprint, salt));
+                    recoverypoint = file_recoverypoint.add_child(file_num, File::unique_fingerprint(_fingerprint, salt));
                 }
-                if (!stack_value.empty())
+                if (checkpoint == nullptr && !dynamic_cast<LiCheckExp*>(cur_task.get()))
+                    cur_task->set_result_fft(true);
+                if (!stack_value.empty() && stack_fft.back() && (checkpoint != nullptr || dynamic_cast<LiCheckExp*>(cur_task.get())))
+                    value_giant();
+                if (!stack_value.empty() && stack_fft.back())
+                {
+                    if (CarefulExp* task = dynamic_cast<CarefulExp*>(cur_task.get()))
+                        task->init_fft(&input, &gwstate, _logging.get(), *stack_fft.back());
+                    if (SlidingWindowExp* task = dynamic_cast<SlidingWindowExp*>(cur_task.get()))
+                        task->init(&input, &gwstate, nullptr, _logging.get(), *stack_fft.back());
+                }
+                else if (!stack_value.empty())
                 {
                     if (CarefulExp* task = dynamic_cast<CarefulExp*>(cur_task.get()))
                         task->init_giant(&input, &gwstate, _logging.get(), std::move(stack_value.back()));
@@ -485,20 +709,41 @@ void PocklingtonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint
                         task->init(&input, &gwstate, checkpoint, recoverypoint, _logging.get(), _a);
                 }
 
-                cur_task->run();
-                if (!stack_value.empty())
+                try
+                {
+                    cur_task->run();
+                }
+                catch (const TaskAbortException&)
+                {
+                    if (Task::abort_flag())
+                    {
+                        if (!stack_value.empty() && !stack_fft.back())
+                            stack_value.back() = std::move(cur_task->X0());
+                        if (write_values())
+                            break;
+                    }
+                    throw;
+                }
+                if (!stack_value.empty() && !stack_fft.back())
                     stack_value.back() = std::move(cur_task->X0());
-                stack_value.push_back(std::move(*cur_task->result()));
+                value_push(task_num);
+                if (cur_task->result_fft())
+                    stack_fft.back() = std::move(cur_task->result_fft());
+                else
+                    stack_value.back() = std::move(*cur_task->result());
                 if (stack.size() == 1)
                     exp = std::move(cur_task->exp());
+                if (stack.back()->cost() > 0)
+                    logging.debug("Stage %d: predicted cost %.0f, %.3f s.\n", task_num, stack.back()->cost(), cur_task->timer());
                 last_progress += cur_task->timer();
+                last_write += cur_task->timer();
                 _logging->progress().next_stage();
                 logging.progress().update(logging.progress().progress_stage(), 0);
                 cur_task.reset();
 
                 if (stack.back()->is_factor())
                 {
-                    if (stack_value.back() != 1 && !_success)
+                    if (value_giant() != 1 && !_success)
                     {
                         _res64 = stack_value.back().to_res64();
                         break;
@@ -511,8 +756,10 @@ void PocklingtonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint
                     _success = true;
                     int index = stack.back()->index();
                     stack.pop_back();
-                    stack_value.pop_back();
-                    if (stack_value.back() != 1)
+                    value_pop();
+                    if (_done_factors.count(index) != 0)
+                        _logging->info("Factor #%d has been tested already.\n", index);
+                    else if (value_giant() != 1)
                     {
                         _logging->info("Factor #%d added to gcd.\n", index);
                         G.push_back(std::move(stack_value.back()));
@@ -547,6 +794,11 @@ void PocklingtonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint
                     if (last_progress > Task::PROGRESS_TIME)
                         progress_factors();
                 }
+                else if (last_write > Task::DISK_WRITE_TIME)
+                {
+                    if (write_values())
+                        break;
+                }
             }
 
             if (!stack.back()->is_factor() && !stack.back()->left()->exp().empty())
@@ -557,13 +809,17 @@ void PocklingtonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint
             {
                 stack.pop_back();
                 if (!stack_value.empty())
-                    stack_value.pop_back();
+                    value_pop();
             }
         }
+        pool.report(logging);
 
-        if (!stack.empty())
+        if (gcd_wait() || !stack.empty())
             break;
-        if (!G.empty() && test_G())
+        // A resumed walk can end without new factors, the completion check still runs.
+        if (test_G())
+            break;
+        if (gcd_wait())
             break;
 
         PrimeIterator primes = PrimeIterator::get();
@@ -574,10 +830,13 @@ void PocklingtonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint
         _a = *primes;
         logging.report_param("a", _a);
 
+        pool.clear();
         gwstate.done();
         gwstate.maxmulbyconst = (_a > GWMULBYCONST_MAX ? 1 : _a);
         input.setup(gwstate);
 
+        _tree_factors = _done_factors;
+        logging.report_param("tree", (int)_tree_factors.size());
         create_tasks(input, logging, exp);
 
         logging.progress_save();
@@ -591,6 +850,8 @@ void PocklingtonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint
     logging.progress().next_stage();
     if (_prime)
         logging.info("%.1f%% of factors tested.\n", std::floor(_done.bitlen()/pct_bitlen)/10.0);
+    if (time_gcd > 0)
+        logging.info("Products %.1f s, gcds %.1f s of which %.1f s not overlapped with the walk.\n", time_product, time_gcd, time_gcd_wait);
     logging.set_prefix("");
     if (!_res64.empty())
         result_not_probable_prime_res64(input, logging, _res64, logging.progress().time_total());
@@ -600,3 +861,31 @@ void PocklingtonGeneric::run(arithmetic::GWState& gwstate, File& file_checkpoint
     file_checkpoint.clear(true);
     file_recoverypoint.clear(true);
 }
+
+void GcdThread::start(Giant&& G, Giant& N)
+{
+    GWASSERT(!_running);
+    _running = true;
+    _G = std::move(G);
+    _N = N;
+    auto gcd = [this]()
+        {
+            auto start = std::chrono::system_clock::now();
+            _G.gcd(_N);
+            _timer = std::chrono::duration<double>(std::chrono::system_clock::now() - start).count();
+        };
+    if (_threads > 1)
+        _thread = std::thread(gcd);
+    else
+        gcd();
+}
+
+Giant& GcdThread::wait()
+{
+    auto start = std::chrono::system_clock::now();
+    if (_thread.joinable())
+        _thread.join();
+    _running = false;
+    _timer_wait = std::chrono::duration<double>(std::chrono::system_clock::now() - start).count();
+    return _G;
+}
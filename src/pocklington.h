@@ -1,6 +1,10 @@
 #pragma once
 
 #include <set>
+#include <map>
+#include <queue>
+#include <functional>
+#include <thread>
 #include "fermat.h"
 
 class Pocklington : public Fermat
@@ -8,20 +12,14 @@ class Pocklington : public Fermat
 public:
     Pocklington(InputNum& input, Options& options, Logging& logging, Proof* proof);
 
-    void run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging, Proof* proof) override;
+    // Predicted cost in multiplications modulo N.
+    static double cost(InputNum& input, Options& options);
 
-protected:
-    class FactorTask
-    {
-    public:
-        FactorTask(int i) : index(i) { }
-        int index;
-        std::unique_ptr<CarefulExp> taskFactor;
-        std::unique_ptr<CarefulExp> taskCheck;
-    };
+    void run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging, Proof* proof) override;
 
 protected:
-    std::vector<FactorTask> _tasks;
+    // Indices of factors not tested yet.
+    std::vector<int> _tasks;
     arithmetic::Giant _done;
 };
 
@@ -32,8 +30,13 @@ class PocklingtonGeneric : public Run
 public:
     PocklingtonGeneric(InputNum& input, Options& options, Logging& logging);
 
+    // Predicted cost in multiplications modulo N.
+    static double cost(InputNum& input, Options& options);
+
     void run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging) override;
 
+    int a() { return _a; }
+
 protected:
     void create_tasks(InputNum& input, Logging& logging, arithmetic::Giant& exp);
 
@@ -42,6 +45,8 @@ protected:
 
     arithmetic::Giant _done;
     std::set<int> _done_factors;
+    // Factors left out of the tree, a subset of _done_factors while the walk is in progress.
+    std::set<int> _tree_factors;
     std::unique_ptr<FactorTree> _tree;
     int _a;
 };
@@ -55,54 +60,156 @@ public:
         _exp = std::forward<S>(exp);
     }
 
-    FactorTree(std::vector<std::unique_ptr<FactorTree>>& tree) : _index(-1)
+    // Merges the two cheapest subtrees first (Huffman). Each factor is exponentiated once per level of the tree above it,
+    // so the total cost of the walk is the sum of factor costs weighted by their depth, and this order minimizes it.
+    FactorTree(std::vector<std::unique_ptr<FactorTree>>& tree, const std::function<double(arithmetic::Giant&)>& cost = bitlen_cost) : _index(-1)
     {
         if (tree.size() == 1)
         {
             _left = std::move(tree[0]);
             return;
         }
+        // The order of insertion breaks ties, the tree has to be the same after restart.
+        std::map<std::pair<double, int>, std::unique_ptr<FactorTree>> queue;
+        int order = 0;
         for (auto it = tree.begin(); it != tree.end(); it++)
+        {
+            (*it)->_cost = cost((*it)->exp());
             (*it)->_left.reset(new FactorTree((*it)->exp(), (*it)->index()));
+            (*it)->_left->_cost = (*it)->_cost;
+            double c = (*it)->_cost;
+            queue.emplace(std::make_pair(c, order++), std::move(*it));
+        }
+        tree.clear();
 
         while (true)
         {
-            std::vector<std::unique_ptr<FactorTree>> next;
-            for (auto it = tree.begin(); it != tree.end(); )
+            std::unique_ptr<FactorTree> a = std::move(queue.begin()->second);
+            queue.erase(queue.begin());
+            std::unique_ptr<FactorTree> b = std::move(queue.begin()->second);
+            queue.erase(queue.begin());
+            double c = a->_cost + b->_cost;
+            // The value of a child node is raised to the product of factors of its sibling.
+            swap(a->exp(), b->exp());
+            std::swap(a->_index, b->_index);
+            std::swap(a->_cost, b->_cost);
+            if (queue.empty())
             {
-                auto& a = *it;  it++;
-                if (it == tree.end())
-                    next.push_back(std::move(a));
-                else
-                {
-                    auto& b = *it;  it++;
-                    swap(a->exp(), b->exp());
-                    std::swap(a->_index, b->_index);
-                    if (tree.size() == 2)
-                    {
-                        _left = std::move(tree[0]);
-                        _right = std::move(tree[1]);
-                        return;
-                    }
-                    next.emplace_back(new FactorTree(a->exp()*b->exp()));
-                    next.back()->_left = std::move(a);
-                    next.back()->_right = std::move(b);
-                }
+                _left = std::move(a);
+                _right = std::move(b);
+                return;
             }
-            tree = std::move(next);
+            std::unique_ptr<FactorTree> node(new FactorTree(a->exp()*b->exp()));
+            node->_cost = c;
+            node->_left = std::move(a);
+            node->_right = std::move(b);
+            queue.emplace(std::make_pair(c, order++), std::move(node));
         }
     }
 
+    static double bitlen_cost(arithmetic::Giant& exp) { return exp.bitlen(); }
+
+    // Sum of factor costs weighted by their depth in the tree built from them.
+    static double walk_cost(const std::vector<double>& costs)
+    {
+        if (costs.size() < 2)
+            return costs.empty() ? 0 : costs[0];
+        std::priority_queue<double, std::vector<double>, std::greater<double>> queue(costs.begin(), costs.end());
+        double total = 0;
+        while (queue.size() > 1)
+        {
+            double c = queue.top();
+            queue.pop();
+            c += queue.top();
+            queue.pop();
+            total += c;
+            queue.push(c);
+        }
+        return total;
+    }
+
     int index() { return _index; }
     arithmetic::Giant& exp() { return _exp; }
     bool is_factor() { return !_left && !_right; }
     bool is_last() { return !_right; }
     FactorTree* left() { return _left.get(); }
     FactorTree* right() { return _right.get(); }
+    // Predicted cost of raising a value to exp().
+    double cost() { return _cost; }
 
 private:
     int _index;
     arithmetic::Giant _exp;
+    double _cost = 0;
     std::unique_ptr<FactorTree> _left;
     std::unique_ptr<FactorTree> _right;
 };
+
+// Raises a value to F/f for every factor f of the tree, F being the product of all factors, by a depth-first walk.
+// Each factor is applied once per level above it, O(F log F) exponent bits instead of O(F^2) for separate exponentiations.
+// Factor nodes raise each result to its factor, X^F has to be the same for all of them, which gives a strong check.
+template<class Value>
+class FactorWalk
+{
+public:
+    // exp(X, e) raises X to e. on_factor(index, X^(F/f), X^F) returns false to stop the walk.
+    FactorWalk(const std::function<void(Value&, arithmetic::Giant&)>& exp, const std::function<bool(int, Value&, Value&)>& on_factor) : _exp(exp), _on_factor(on_factor) { }
+
+    // X is consumed.
+    bool run(FactorTree* node, Value& X)
+    {
+        if (!node->exp().empty() && node->exp() != 1)
+            _exp(X, node->exp());
+        for (FactorTree* child : {node->left(), node->right()})
+        {
+            if (child == nullptr)
+                continue;
+            Value Y;
+            if (child == node->left() && node->right() != nullptr)
+                Y = X;
+            else
+                Y = std::move(X);
+            if (child->is_factor())
+            {
+                Value check;
+                check = Y;
+                _exp(check, child->exp());
+                if (!_on_factor(child->index(), Y, check))
+                    return false;
+            }
+            else if (!run(child, Y))
+                return false;
+        }
+        return true;
+    }
+
+private:
+    std::function<void(Value&, arithmetic::Giant&)> _exp;
+    std::function<bool(int, Value&, Value&)> _on_factor;
+};
+
+// Computes gcd(G, N) with GMP on a separate thread while the tree walk continues on GWnum threads.
+// The thread touches only its own Giants, see parallel_for(). With a single thread the gcd is computed by start().
+// The walk itself stays serial: its GWState already runs on all threads, and a clone per branch would split them.
+class GcdThread
+{
+public:
+    GcdThread(int threads) : _threads(threads) { }
+    ~GcdThread() { if (_thread.joinable()) _thread.join(); }
+
+    void start(arithmetic::Giant&& G, arithmetic::Giant& N);
+    arithmetic::Giant& wait();
+    bool running() { return _running; }
+    // Duration of the last gcd and the part of it the caller of wait() was blocked.
+    double timer() { return _timer; }
+    double timer_wait() { return _timer_wait; }
+
+private:
+    int _threads;
+    bool _running = false;
+    std::thread _thread;
+    arithmetic::Giant _G;
+    arithmetic::Giant _N;
+    double _timer = 0;
+    double _timer_wait = 0;
+};
@@ -130,7 +130,7 @@ void Proof::calc_points(int iterations, bool smooth, InputNum& input, Options& o
             options.ProofPointsPerCheck = _count/options.StrongCount.value();
     }
     int points_per_check = options.ProofPointsPerCheck ? options.ProofPointsPerCheck.value() : 1;
-    bool value_points = input.type() == input.KBNC && input.k() != 0 && input.b() == 2; // base 2 FFT, not general, not need_mod
+    bool value_points = input.type() == input.KBNC && input.k() != 0 && input.b() == 2; // base 2 FFT, not general, values are reduced mod N if need_mod
     _points.clear();
 
     /*if (input.b() != 2 && options.ProofPointsPerCheck && !Li())
@@ -1,5 +1,7 @@
 
 #include <cmath>
+#include <algorithm>
+#include <filesystem>
 #include <string.h>
 #include <signal.h>
 
@@ -18,6 +20,7 @@
 #include "proof.h"
 #include "pocklington.h"
 #include "morrison.h"
+#include "small.h"
 #include "order.h"
 #include "testing.h"
 #include "batch.h"
@@ -33,6 +36,102 @@ int net_main(int argc, char *argv[]);
 
 using namespace arithmetic;
 
+// Adds the canonical form to a checkpoint written with the current FFT, so it can be loaded with any FFT.
+bool migrate_state(File& file, GWArithmetic& gw, Logging& logging)
+{
+    std::unique_ptr<Reader> reader(file.get_reader());
+    if (!reader)
+    {
+        logging.info("%s not found.\n", file.filename().data());
+        return true;
+    }
+    std::unique_ptr<TaskState> state;
+    bool res = false;
+    if (reader->type() == BaseExp::StateSerialized::TYPE)
+    {
+        BaseExp::StateSerialized* serialized = new BaseExp::StateSerialized();
+        state.reset(serialized);
+        if (!serialized->read(*reader))
+            state.reset();
+        else
+            res = serialized->migrate(gw);
+    }
+    else if (reader->type() == StrongCheckMultipointExp::StrongCheckState::TYPE)
+    {
+        StrongCheckMultipointExp::StrongCheckState* check = new StrongCheckMultipointExp::StrongCheckState();
+        state.reset(check);
+        if (!check->read(*reader))
+            state.reset();
+        else
+            res = check->migrate(gw);
+    }
+    else if (reader->type() == LucasUVMul::StrongCheckState::TYPE)
+    {
+        LucasUVMul::StrongCheckState* check = new LucasUVMul::StrongCheckState();
+        state.reset(check);
+        if (!check->read(*reader))
+            state.reset();
+        else
+            res = check->migrate(gw);
+    }
+    else
+    {
+        logging.info("%s doesn't depend on FFT.\n", file.filename().data());
+        return true;
+    }
+    reader.reset();
+    if (state && !res)
+    {
+        logging.error("%s was written with another FFT, run -migrate with the options the test was started with.\n", file.filename().data());
+        return false;
+    }
+    if (!state || !file.write(*state))
+    {
+        logging.error("Failed to migrate %s.\n", file.filename().data());
+        return false;
+    }
+    logging.info("%s migrated at iteration %d.\n", file.filename().data(), state->iteration());
+    return true;
+}
+
+// Migrates the file and its child files. Children are opened while the test runs, with fingerprints derived from run state,
+// so they are found on disk by name and opened with the fingerprint in their header.
+bool migrate_checkpoint(File& file, GWArithmetic& gw, Logging& logging)
+{
+    bool res = migrate_state(file, gw, logging);
+
+    std::filesystem::path path(file.filename());
+    std::string prefix = path.filename().string() + ".";
+    std::vector<std::filesystem::path> children;
+    std::error_code ec;
+    for (auto& entry : std::filesystem::directory_iterator(path.has_parent_path() ? path.parent_path() : std::filesystem::path("."), ec))
+    {
+        std::string name = entry.path().filename().string();
+        if (name.compare(0, prefix.size(), prefix) == 0 && !(name.size() > 4 && name.compare(name.size() - 4, 4, ".md5") == 0))
+            children.push_back(entry.path());
+    }
+    std::sort(children.begin(), children.end());
+    for (auto& child_path : children)
+    {
+        // Header: magic number, application and type, fingerprint.
+        uint32_t header[3];
+        FILE* fd = fopen(child_path.string().data(), "rb");
+        bool valid = fd != nullptr && fread(header, sizeof(uint32_t), 3, fd) == 3 && header[0] == MAGIC_NUM;
+        if (fd != nullptr)
+            fclose(fd);
+        if (!valid)
+        {
+            logging.error("%s is not a checkpoint.\n", child_path.string().data());
+            res = false;
+            continue;
+        }
+        File child(child_path.string(), header[2]);
+        child.hash = file.hash;
+        res &= migrate_state(child, gw, logging);
+    }
+    return res;
+}
+
 void sigterm_handler(int signo)
 {
     Task::abort();
@@ -63,6 +162,7 @@ int main(int argc, char *argv[])
     //  9 LucasV checkpoint
     // 10 LucasUV checkpoint
     // 11 LucasUV strong check checkpoint
+    // 12 DAC chain cache
 
     Options options;
     int proof_op = Proof::NO_OP;
@@ -75,6 +175,7 @@ int main(int argc, char *argv[])
     InputNum input;
     bool show_info = false;
     bool trial_division = false;
+    bool migrate = false;
     int log_level = Logging::LEVEL_WARNING;
     std::string log_file;
     bool log_prime = false;
@@ -84,6 +185,9 @@ int main(int argc, char *argv[])
         .value_number("-t", ' ', options.thread_count, 1, 256)
         .value_number("-spin", ' ', options.spin_threads, 0, 256)
         .value_enum("-cpu", ' ', options.instructions, Enum<std::string>().add("SSE2", "SSE2").add("AVX", "AVX").add("FMA3", "FMA3").add("AVX512F", "AVX512F"))
+        .value_number("-mem", ' ', MultipointExp::MEMORY_LIMIT, 1, INT_MAX)
+        .value_string("-dac", ' ', DACCache::FILENAME)
+        .value_number("-small", ' ', SmallRun::MAX_BITLEN, 0, INT_MAX)
         .value_number("-fft", '+', options.next_fft_count, 0, 5)
         .group("-fft")
             .value_number("+", 0, options.next_fft_count, 0, 5)
@@ -144,7 +248,7 @@ int main(int argc, char *argv[])
             .value_number("a", ' ', options.FermatBase, 2, INT_MAX)
             .end()
             .on_check(options.ForceFermat, true)
-        .value_code("-order", ' ', [&](const char* param) { options.OrderA.reset(new InputNum()); return options.OrderA->parse(param, false) && options.OrderA->value() > 1; })
+        .value_code("-order", ' ', [&](const char* param) { return options.parse_order(param); })
         .group("-divides")
             .exclusive()
                 .ex_case()
@@ -236,6 +340,20 @@ int main(int argc, char *argv[])
         .check("-i", show_info, true)
         .check("-info", show_info, true)
         .check("-trial", trial_division, true)
+        .check("-migrate", migrate, true)
+        .check("-plan", options.Plan, true)
+        .group("-select")
+            .check("simple", options.Generic, false)
+            .check("generic", options.Generic, true)
+            .check("smooth", options.Smooth, true)
+            .check("nosmooth", options.Smooth, false)
+            .end()
+        .group("-prpfirst")
+            .exclusive()
+                .ex_case().check("on", options.PRPFirst, true).end()
+                .ex_case().check("off", options.PRPFirst, false).end()
+                .end()
+            .end()
         .value_code("-q", 0, [&](const char* param) {
                 if (param[0] != '\"' && !isdigit(param[0]))
                     return false;
@@ -276,6 +394,8 @@ int main(int argc, char *argv[])
         printf("\t-batch\n");
         printf("\t-order {<a> | \"<number>\"}\n");
         printf("\t-divides {f | gf | xgf} [limit 12]\n");
+        printf("\t-migrate\n");
+        printf("\t-plan\n");
         printf("Options:\n");
         printf("\t-ini <filename>\n");
         printf("\t-log [{debug | info | warning | error}] [prime] [file <filename>]\n");
@@ -285,8 +405,13 @@ int main(int argc, char *argv[])
         printf("\t-fft+1\n");
         printf("\t-fft [+<inc>] [safety <margin>] [generic] [info]\n");
         printf("\t-cpu {SSE2 | AVX | FMA3 | AVX512F}\n");
+        printf("\t-mem <MB>\n");
+        printf("\t-dac <filename>\n");
+        printf("\t-small <bits>\n");
         printf("\t-trial\n");
         printf("\t-fermat [a <a>]\n");
+        printf("\t-select [{simple | generic}] [{smooth | nosmooth}]\n");
+        printf("\t-prpfirst {on | off}\n");
         printf("\t-factors [list <factor>,...] [file <filename>] [all]\n");
         printf("\t-check [{near | always| never}] [strong [disable] [count <count>] [L <L>]]\n");
         printf("\t-proof save <count> [name <proof> <product>] [pack <name>] [keep]\n");
@@ -304,7 +429,7 @@ int main(int argc, char *argv[])
     if (show_info && !options.information_only)
         return PRST_EXIT_NORMAL;
 
-    Logging logging(options.information_only && log_level > Logging::LEVEL_INFO ? Logging::LEVEL_INFO : log_level);
+    Logging logging((options.information_only || options.Plan) && log_level > Logging::LEVEL_INFO ? Logging::LEVEL_INFO : log_level);
     if (!log_file.empty())
         logging.file_log(log_file);
     if (!log_prime)
@@ -342,8 +467,8 @@ int main(int argc, char *argv[])
 
     uint32_t fingerprint = input.fingerprint();
     std::string filename_suffix;
-    if (options.OrderA && !options.OrderA->empty() && options.OrderA->value() > 1)
-        filename_suffix = ".ord" + std::to_string(options.OrderA->fingerprint());
+    if (!options.OrderA.empty())
+        filename_suffix = ".ord" + std::to_string(options.order_fingerprint());
     else if (!options.Divides.empty())
         filename_suffix = ".div";
     else if (options.FermatBase)
@@ -372,10 +497,23 @@ int main(int argc, char *argv[])
     std::unique_ptr<Run> run(Run::create(input, options, logging, proof.get()));
     if (!run)
         return PRST_EXIT_FAILURE;
+    if (options.Plan)
+    {
+        if (run == proof)
+            run.release();
+        return PRST_EXIT_NORMAL;
+    }
     if (run->finished())
         return PRST_EXIT_NORMAL;
     if (run == proof)
         proof.release();
+    SmallRun* small = dynamic_cast<SmallRun*>(run.get());
+    if (small != nullptr && !migrate)
+    {
+        small->run(logging);
+        file_progress.clear();
+        return small->success() ? PRST_EXIT_PRIMEFOUND : PRST_EXIT_NORMAL;
+    }
 
     std::unique_ptr<File> file_proofpoint;
     std::unique_ptr<File> file_proofproduct;
@@ -410,7 +548,7 @@ int main(int argc, char *argv[])
     File file_recoverypoint(filename_prefix + filename_suffix + ".rcpt", fingerprint);
 
     GWState gwstate;
-    options.configure(gwstate);
+    options.configure(gwstate, input);
     logging.progress().configure(gwstate);
     try
     {
@@ -436,6 +574,18 @@ int main(int argc, char *argv[])
     }
     logging.info("Using %s.\n", gwstate.fft_description.data());
 
+    if (migrate)
+    {
+        bool res;
+        {
+            GWArithmetic gw(gwstate);
+            res = migrate_checkpoint(file_checkpoint, gw, logging);
+            res &= migrate_checkpoint(file_recoverypoint, gw, logging);
+        }
+        gwstate.done();
+        return res ? PRST_EXIT_NORMAL : PRST_EXIT_FAILURE;
+    }
+
     bool success = false;
     bool failed = false;
     try
@@ -444,6 +594,11 @@ int main(int argc, char *argv[])
         success = run->success();
         file_progress.clear();
     }
+    catch (const CheckpointFFTException&)
+    {
+        logging.error("The checkpoint was written with another FFT, run -migrate with the options the test was started with.\n");
+        failed = true;
+    }
     catch (const TaskAbortException&)
     {
         if (!gwstate.information_only)
@@ -461,23 +616,118 @@ int main(int argc, char *argv[])
     }
 
     gwstate.done();
+    // Chains found during the test by mul_prime and progress_init.
+    DACCache::save();
 
     return success ? PRST_EXIT_PRIMEFOUND : failed ? PRST_EXIT_FAILURE : PRST_EXIT_NORMAL;
 }
 
+void Options::configure(GWState& gwstate, InputNum& input)
+{
+    configure(gwstate);
+    // Cyclotomic inputs are deliberately left out, their modulus is chosen by InputNum::setup which parses them.
+    if (input.type() != InputNum::KBNC)
+        return;
+    // A proper divisor of k*b^n+c is at least a bit shorter, plain k*b^n+c inputs skip the division.
+    if (input.bitlen() > log2(input.gk()) + input.n()*log2(input.gb()))
+        return;
+    // N = (k*b^n+c)/d: the test runs modulo k*b^n+c with IBDWT, results are reduced mod N where need_mod().
+    Giant kbnc = input.gk()*power(input.gb(), input.n());
+    kbnc += input.c();
+    if (kbnc == input.value())
+        return;
+    Giant tmp = kbnc;
+    tmp %= input.value();
+    if (tmp == 0)
+        gwstate.known_factors = kbnc/input.value();
+}
+
+bool Options::parse_order(const char* param)
+{
+    OrderA.clear();
+    std::string list(param);
+    for (size_t start = 0, end = 0; end < list.size(); start = end + 1)
+    {
+        end = list.find(',', start);
+        if (end == std::string::npos)
+            end = list.size();
+        OrderA.emplace_back(new InputNum());
+        if (!OrderA.back()->parse(list.substr(start, end - start), false) || OrderA.back()->value() <= 1)
+            return false;
+    }
+    return !OrderA.empty();
+}
+
+uint32_t Options::order_fingerprint()
+{
+    uint32_t fingerprint = OrderA[0]->fingerprint();
+    for (int i = 1; i < OrderA.size(); i++)
+        fingerprint = File::unique_fingerprint(fingerprint, std::to_string(OrderA[i]->fingerprint()));
+    return fingerprint;
+}
+
+// Reports the tests considered by Run::create, at the info level with -plan. Negative cost marks a test not applicable to the input.
+void report_plan(std::vector<std::pair<std::string, double>>& plan, int selected, Options& options, Logging& logging)
+{
+    for (int i = 0; i < plan.size(); i++)
+    {
+        if (plan[i].second < 0)
+            continue;
+        const char* action = i == selected ? "Selected" : "Considered";
+        if (options.Plan)
+            logging.info("%s %s, predicted cost %.0f.\n", action, plan[i].first.data(), plan[i].second);
+        else
+            logging.debug("%s %s, predicted cost %.0f.\n", action, plan[i].first.data(), plan[i].second);
+    }
+}
+
+// Selects the cheapest applicable test, the first one is the simpler version. -select {simple | generic} overrides the costs.
+int select_plan(std::vector<std::pair<std::string, double>>& plan, Options& options, Logging& logging, bool prefer_simple)
+{
+    int selected = -1;
+    if (options.Generic)
+        selected = options.Generic.value() ? 1 : 0;
+    else if (prefer_simple)
+        selected = 0;
+    if (selected >= 0 && plan[selected].second < 0)
+    {
+        if (options.Generic)
+            logging.warning("%s is not applicable to this number.\n", plan[selected].first.data());
+        selected = -1;
+    }
+    if (selected < 0)
+        for (int i = 0; i < plan.size(); i++)
+            if (plan[i].second >= 0 && (selected < 0 || plan[i].second < plan[selected].second))
+                selected = i;
+    report_plan(plan, selected, options, logging);
+    return selected;
+}
+
+// Fermat tests choose between smooth and plain exponentiation, -select {smooth | nosmooth} overrides the costs.
+void plan_fermat(InputNum& input, Options& options, Logging& logging, const char* name)
+{
+    std::vector<std::pair<std::string, double>> plan;
+    bool smooth_valid = Fermat::smooth_valid(input);
+    plan.emplace_back(std::string(name) + " with smooth exponentiation", smooth_valid ? Fermat::cost(input, options, true) : -1);
+    plan.emplace_back(name, Fermat::cost(input, options, false));
+    report_plan(plan, Fermat::smooth(input, options) ? 0 : 1, options, logging);
+}
+
 Run* Run::create(InputNum& input, Options& options, Logging& logging, Proof* proof)
 {
     logging.report_param("maxmulbyconst", 1);
 
     // -order
-    if (options.OrderA && !options.OrderA->empty() && options.OrderA->value() > 1)
+    if (!options.OrderA.empty())
     {
         if (input.type() != InputNum::KBNC || input.c() != 1 || !input.cofactor().empty())
         {
             logging.error("Order can be computed only for fully factored K*B^N+1 primes.\n");
             return nullptr;
         }
-        return new Order(input, options, logging);
+        if (options.OrderA.size() > 1)
+            return new MultiOrder(input, options, logging);
+        return new Order(input, options, logging, *options.OrderA[0]);
     }
 
     // -divides
@@ -497,24 +747,46 @@ Run* Run::create(InputNum& input, Options& options, Logging& logging, Proof* pro
     
     // -fermat
     if (options.ForceFermat || input.type() == InputNum::GENERIC || std::abs(input.c()) != 1)
+    {
+        plan_fermat(input, options, logging, "Fermat test");
+        if (SmallRun::applicable(input, options, proof))
+            return new SmallRun(Fermat::FERMAT, input, options, logging);
         return new Fermat(Fermat::FERMAT, input, options, logging, proof);
+    }
 
     // Proth
     if (input.type() == InputNum::KBNC && input.c() == 1 && input.b() == 2 && log2(input.gk()) < input.n())
+    {
+        plan_fermat(input, options, logging, "Proth test");
+        if (SmallRun::applicable(input, options, proof))
+            return new SmallRun(Fermat::PROTH, input, options, logging);
         return new Fermat(Fermat::PROTH, input, options, logging, proof);
+    }
 
     input.expand_factors();
     if (!input.is_half_factored())
     {
         logging.warning("Not enough factors for an available deterministic test.\n");
+        plan_fermat(input, options, logging, "Fermat test");
+        if (SmallRun::applicable(input, options, proof))
+            return new SmallRun(Fermat::AUTO, input, options, logging);
         return new Fermat(Fermat::AUTO, input, options, logging, proof);
     }
 
+    // The simpler versions of the tests keep a task per factor, the generic ones walk a FactorTree.
+    bool simple = input.type() == InputNum::KBNC && input.n() > 10;
+    std::vector<std::pair<std::string, double>> plan;
+
     // Pocklington
     if (input.c() == 1)
     {
-        // Simpler version of the test for small number of factors.
-        if (input.type() == InputNum::KBNC && input.n() > 10 && input.factors().size() < 10)
+        plan.emplace_back("Pocklington test", simple ? Pocklington::cost(input, options) : -1);
+        plan.emplace_back("generic Pocklington test", PocklingtonGeneric::cost(input, options));
+        // Only the simpler version supports proofs.
+        int selected = select_plan(plan, options, logging, proof != nullptr);
+        if (SmallRun::applicable(input, options, proof))
+            return new SmallRun(selected == 0 ? Fermat::POCKLINGTON : SmallRun::POCKLINGTON_GENERIC, input, options, logging);
+        if (selected == 0)
             return new Pocklington(input, options, logging, proof);
         return new PocklingtonGeneric(input, options, logging);
 
@@ -523,10 +795,33 @@ Run* Run::create(InputNum& input, Options& options, Logging& logging, Proof* pro
     // Morrison (based on Lucas chains, 2 times slower)
     if (input.c() == -1)
     {
-        // Simpler version of the test for small number of factors.
-        if (input.type() == InputNum::KBNC && input.n() > 10 && input.factors().size() < 10)
-            return new Morrison(input, options, logging);
-        return new MorrisonGeneric(input, options, logging);
+        plan.emplace_back("Morrison test", simple ? Morrison::cost(input, options) : -1);
+        plan.emplace_back("generic Morrison test", MorrisonGeneric::cost(input, options));
+        int selected = select_plan(plan, options, logging, false);
+        if (SmallRun::applicable(input, options, nullptr))
+            return new SmallRun(selected == 0 ? SmallRun::MORRISON : SmallRun::MORRISON_GENERIC, input, options, logging);
+
+        int stages = (int)logging.progress().costs().size();
+        Run* run;
+        if (selected == 0)
+            run = new Morrison(input, options, logging);
+        else
+            run = new MorrisonGeneric(input, options, logging);
+
+        // The Fermat test is needed only if the Lucas test didn't finish in its constructor.
+        if (options.PRPFirst && options.PRPFirst.value() && proof == nullptr && !options.information_only && !run->finished())
+        {
+            int maxmulbyconst = logging.progress().param_int("maxmulbyconst");
+            int stages_lucas = (int)logging.progress().costs().size();
+            Fermat* prp = new Fermat(Fermat::FERMAT, input, options, logging, nullptr);
+            if (logging.progress().param_int("maxmulbyconst") < maxmulbyconst)
+                logging.report_param("maxmulbyconst", maxmulbyconst);
+            // The Fermat test goes first, so do its progress stages.
+            auto& costs = logging.progress().costs();
+            std::rotate(costs.begin() + stages, costs.begin() + stages_lucas, costs.end());
+            return new Triage(prp, run, input, options);
+        }
+        return run;
 
     }
 
@@ -534,6 +829,12 @@ Run* Run::create(InputNum& input, Options& options, Logging& logging, Proof* pro
     return nullptr;
 }
 
+double Run::gcd_cost(InputNum& input)
+{
+    // GMP gcd is subquadratic, O(log N) multiplications of a slower arithmetic.
+    return 4*std::log2(input.bitlen());
+}
+
 void Run::primality_result(Logging& logging)
 {
     if (prime())
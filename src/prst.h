@@ -2,6 +2,7 @@
 
 #include <optional>
 #include <string>
+#include <vector>
 
 #define PRST_EXIT_NORMAL 0
 #define PRST_EXIT_FAILURE 1
@@ -14,7 +15,8 @@ public:
     // Modes
 
     bool ForceFermat = false;
-    std::unique_ptr<InputNum> OrderA;
+    // Bases of -order, several bases share the setup modulo the same prime.
+    std::vector<std::unique_ptr<InputNum>> OrderA;
     std::string Divides;
     std::optional<int> DividesLimit;
 
@@ -43,6 +45,14 @@ public:
     std::optional<int> RootOfUnitySecurity;
 
     std::optional<bool> AllFactors;
+    // Runs a Fermat test before Morrison tests, on by default in batch mode.
+    std::optional<bool> PRPFirst;
+
+    // Test selection
+
+    bool Plan = false;
+    std::optional<bool> Generic;
+    std::optional<bool> Smooth;
 
     // GWState options
 
@@ -66,6 +76,12 @@ public:
         gwstate.information_only = information_only;
         gwstate.known_factors = 1;
     }
+    // Passes the known factors of k*b^n+c to GWState when N is its divisor.
+    void configure(arithmetic::GWState& gwstate, InputNum& input);
+    // Parses the comma-separated bases of -order.
+    bool parse_order(const char* param);
+    // Fingerprint of all -order bases, the first base alone keeps the old checkpoint names.
+    uint32_t order_fingerprint();
 };
 
 class Proof;
@@ -87,6 +103,8 @@ public:
     bool finished() { return _success || _prime || !_res64.empty() || !_factor.empty() || !_result.empty(); }
 
     static Run* create(InputNum& input, Options& options, Logging& logging, Proof* proof = nullptr);
+    // Predicted cost of a gcd with N in multiplications modulo N.
+    static double gcd_cost(InputNum& input);
     virtual void run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging) = 0;
     void primality_result(Logging& logging);
     static void result_prime(InputNum& input, Logging& logging, double time);
@@ -0,0 +1,408 @@
+#include <set>
+#include <chrono>
+#include <string.h>
+
+#include "gwnum.h"
+#include "cpuid.h"
+#include "integer.h"
+
+#include "small.h"
+#include "fermat.h"
+
+using namespace arithmetic;
+
+int SmallRun::MAX_BITLEN = 0;
+
+int genProthBase(Giant& k, uint32_t n);
+
+SmallRun::SmallRun(int test, InputNum& input, Options& options, Logging& logging) : Run("Fermat test", input, options), _test(test)
+{
+    _fingerprint = input.fingerprint();
+    _N = input.value();
+    if (test == POCKLINGTON_GENERIC)
+    {
+        _name = "generic Pocklington test";
+        _a = options.FermatBase ? options.FermatBase.value() : 3;
+    }
+    else if (test == MORRISON || test == MORRISON_GENERIC)
+        init_morrison(logging);
+    else
+        init_fermat(logging);
+}
+
+bool SmallRun::applicable(InputNum& input, Options& options, Proof* proof)
+{
+    return proof == nullptr && !options.information_only && input.bitlen() <= MAX_BITLEN;
+}
+
+// Chooses the test type and the base as the Fermat constructor does.
+void SmallRun::init_fermat(Logging& logging)
+{
+    _type = _test;
+    if (input.type() != InputNum::KBNC || input.c() != 1)
+        _type = Fermat::FERMAT;
+    _a = _options.FermatBase ? _options.FermatBase.value() : 3;
+    if (_type == Fermat::FERMAT)
+        return;
+
+    int n = 0;
+    Giant exp;
+    Giant exp_pocklington;
+    exp = 1;
+    exp_pocklington = 1;
+    for (auto& factor : input.factors())
+        if (factor.first == 2)
+            n = factor.second;
+        else
+        {
+            exp *= power(factor.first, factor.second);
+            if (factor.second > 1)
+                exp_pocklington *= power(factor.first, factor.second - 1);
+        }
+    if (n == 0)
+    {
+        _factor = 2;
+        primality_result(logging);
+        return;
+    }
+    if (!input.cofactor().empty())
+    {
+        exp *= input.cofactor();
+        exp_pocklington *= input.cofactor();
+    }
+
+    if (log2(exp) < n)
+        _type = Fermat::PROTH;
+    else if (_type != Fermat::POCKLINGTON)
+        _type = Fermat::FERMAT;
+    if (_type == Fermat::PROTH)
+        _name = "Proth test";
+    if (_type == Fermat::POCKLINGTON)
+        _name = "Pocklington test";
+
+    if (_type == Fermat::PROTH || (_type == Fermat::POCKLINGTON && (n >= input.n() || (_options.AllFactors && _options.AllFactors.value()))))
+    {
+        _a = genProthBase(_type == Fermat::POCKLINGTON ? exp_pocklington : exp, n);
+        if (_a < 0)
+        {
+            _factor = -_a;
+            primality_result(logging);
+        }
+    }
+}
+
+// Chooses Q and P as the Morrison constructors do.
+void SmallRun::init_morrison(Logging& logging)
+{
+    _name = _test == MORRISON ? "Morrison test" : "generic Morrison test";
+    int n = 0;
+    Giant exp;
+    exp = 1;
+    for (auto& factor : input.factors())
+        if (factor.first == 2)
+            n = factor.second;
+        else
+            exp *= power(factor.first, factor.second);
+    _negQ = (n > 1);
+    if (_test == MORRISON_GENERIC)
+        return;
+    if (n == 0)
+    {
+        _factor = 2;
+        primality_result(logging);
+        return;
+    }
+    if (!input.cofactor().empty())
+        exp *= input.cofactor();
+    if (log2(exp) < n)
+        _name = "Morrison (LLR) test";
+    for (_P = (_negQ ? 1 : 3); kronecker(_P*_P - (_negQ ? -4 : 4), _N) == 1; _P++);
+}
+
+void SmallRun::run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging)
+{
+    run(logging);
+}
+
+void SmallRun::run(Logging& logging)
+{
+    if (lane())
+    {
+        calc();
+        report(logging);
+        return;
+    }
+
+    _success = false;
+    _prime = false;
+    _res64 = "";
+    logging.progress().time_init(0);
+    logging.info("Using GMP arithmetic.\n");
+
+    if (_type == Fermat::POCKLINGTON)
+        run_pocklington(logging, _a, false);
+    else if (_test == POCKLINGTON_GENERIC)
+        run_pocklington(logging, _a, true);
+    else if (_test == MORRISON)
+        run_morrison(logging, false);
+    else if (_test == MORRISON_GENERIC)
+    {
+        for (_P = (_negQ ? 1 : 5); kronecker(_P*_P - (_negQ ? -4 : 4), _N) == 1; _P++);
+        run_morrison(logging, true);
+    }
+}
+
+bool SmallRun::lane()
+{
+    return _test <= Fermat::POCKLINGTON && (_type == Fermat::FERMAT || _type == Fermat::PROTH);
+}
+
+void SmallRun::calc()
+{
+    auto start = std::chrono::system_clock::now();
+    _success = false;
+    _prime = false;
+    _res64 = "";
+
+    Giant exp;
+    exp = _N;
+    exp -= 1;
+    if (_type == Fermat::PROTH)
+        exp >>= 1;
+    Giant x;
+    x = _a;
+    x.arithmetic().powermod(x, exp, _N, x);
+
+    if (_type == Fermat::PROTH)
+    {
+        Giant tmp = square(x);
+        tmp %= _N;
+        _success = (tmp == 1);
+        tmp = x;
+        tmp += 1;
+        if (tmp == _N)
+            _prime = true;
+        else
+            _res64 = x.to_res64();
+    }
+    else if (x == 1)
+        _success = true;
+    else
+        _res64 = x.to_res64();
+
+    _time = std::chrono::duration<double>(std::chrono::system_clock::now() - start).count();
+}
+
+void SmallRun::report(Logging& logging)
+{
+    logging.info("Using GMP arithmetic.\n");
+    if (_type == Fermat::PROTH)
+        logging.info("Proth test of %s, a = %d.\n", input.display_text().data(), _a);
+    else
+        logging.info("Fermat probabilistic test of %s, a = %d.\n", input.display_text().data(), _a);
+    logging.progress().time_init(_time);
+    logging.progress().update(1, 0);
+    primality_result(logging);
+}
+
+void SmallRun::run_pocklington(Logging& logging, int a, bool generic)
+{
+    logging.info("Pocklington test of %s, a = %d.\n", input.display_text().data(), a);
+
+    bool AllFactors = _options.AllFactors && _options.AllFactors.value();
+    std::set<int> done_factors;
+    Giant done;
+    done = 1;
+    Giant exp;
+    exp = _N;
+    exp -= 1;
+    Giant ga, x, tmp;
+    while (true)
+    {
+        ga = a;
+        ga.arithmetic().powermod(ga, exp, _N, x);
+        if (x != 1)
+        {
+            _success = false;
+            _res64 = x.to_res64();
+            break;
+        }
+        _success = true;
+
+        for (int i = 0; i < input.factors().size(); i++)
+        {
+            if (!AllFactors && square(done) > _N)
+                break;
+            if (done_factors.count(i) != 0)
+                continue;
+            auto& f = input.factors()[i];
+            tmp = exp/f.first;
+            ga.arithmetic().powermod(ga, tmp, _N, x);
+            if (x == 1)
+            {
+                logging.debug("Factor #%d can't be tested with a=%d.\n", i, a);
+                continue;
+            }
+            x -= 1;
+            x.gcd(_N);
+            if (x != 1)
+            {
+                _factor = std::move(x);
+                break;
+            }
+            done *= power(f.first, f.second);
+            done_factors.insert(i);
+        }
+        if (!_factor.empty())
+            break;
+        if (done_factors.size() == input.factors().size() || (!AllFactors && square(done) > _N))
+        {
+            _prime = true;
+            break;
+        }
+
+        PrimeIterator primes = PrimeIterator::get();
+        for (; *primes <= a; primes++);
+        if (generic && (AllFactors || input.factors()[0].second > _N.bitlen()/100) && done_factors.count(0) == 0)
+            while (kronecker(*primes, _N) != -1)
+                primes++;
+        a = *primes;
+        logging.info("Restarting Pocklington test of %s, a = %d.\n", input.display_text().data(), a);
+    }
+
+    logging.progress().update(1, 0);
+    if (!_res64.empty() && generic)
+        result_not_probable_prime_res64(input, logging, _res64, logging.progress().time_total());
+    else
+        primality_result(logging);
+}
+
+void SmallRun::run_morrison(Logging& logging, bool generic)
+{
+    logging.info("%s of %s, P = %d, Q = %d.\n", generic ? "Morrison test" : _name.data(), input.display_text().data(), _P, _negQ ? -1 : 1);
+
+    bool AllFactors = _options.AllFactors && _options.AllFactors.value();
+    std::set<int> done_factors;
+    Giant done;
+    done = 1;
+    Giant exp;
+    exp = _N;
+    exp += 1;
+    Giant V, tmp;
+    while (true)
+    {
+        tmp = _P*4;
+        tmp *= _P*_P - (_negQ ? -4 : 4);
+        tmp.gcd(_N);
+        if (tmp != 1)
+        {
+            _factor = std::move(tmp);
+            break;
+        }
+
+        // Q = 1 : V_{N+1} = 2, Q = -1 : V_{(N+1)/2} = 0.
+        tmp = exp;
+        if (_negQ)
+            tmp >>= 1;
+        lucas_V(tmp, V);
+        if (V != (_negQ ? 0 : 2))
+        {
+            _success = false;
+            _res64 = V.to_res64();
+            break;
+        }
+        if (!_success && _negQ)
+            for (int i = 0; i < input.factors().size(); i++)
+                if (input.factors()[i].first == 2)
+                {
+                    done <<= input.factors()[i].second;
+                    done_factors.insert(i);
+                }
+        _success = true;
+
+        for (int i = 0; i < input.factors().size(); i++)
+        {
+            if (!AllFactors && square(done) > _N)
+                break;
+            if (done_factors.count(i) != 0)
+                continue;
+            auto& f = input.factors()[i];
+            tmp = exp/f.first;
+            if (_negQ)
+                tmp >>= 1;
+            lucas_V(tmp, V);
+            if (!_negQ)
+            {
+                V += _N;
+                V -= 2;
+                V %= _N;
+            }
+            if (V == 0)
+            {
+                logging.debug("Factor #%d can't be tested with P=%d.\n", i, _P);
+                continue;
+            }
+            V.gcd(_N);
+            if (V != 1)
+            {
+                _factor = std::move(V);
+                break;
+            }
+            done *= power(f.first, f.second);
+            done_factors.insert(i);
+        }
+        if (!_factor.empty())
+            break;
+        if (done_factors.size() == input.factors().size() || (!AllFactors && square(done) > _N))
+        {
+            _prime = true;
+            break;
+        }
+
+        for (_P++; kronecker(_P*_P - (_negQ ? -4 : 4), _N) == 1; _P++);
+        logging.info("Restarting Morrison test of %s, P = %d, Q = %d.\n", input.display_text().data(), _P, _negQ ? -1 : 1);
+    }
+
+    logging.progress().update(1, 0);
+    if (!_res64.empty())
+        result_not_probable_prime_res64(input, logging, _res64, logging.progress().time_total());
+    else
+        primality_result(logging);
+}
+
+// Binary ladder on (V_k, V_{k+1}) with V_0 = 2, V_1 = P and Q = -1 if _negQ, 1 otherwise.
+// V_{2k} = V_k^2 - 2Q^k, V_{2k+1} = V_k*V_{k+1} - P*Q^k.
+void SmallRun::lucas_V(Giant& exp, Giant& V)
+{
+    Giant V1;
+    V = 2;
+    V1 = _P;
+    bool odd = false;
+    for (int i = exp.bitlen() - 1; i >= 0; i--)
+    {
+        int Qk = (_negQ && odd) ? -1 : 1;
+        if (exp.bit(i))
+        {
+            V *= V1;
+            V += _N;
+            V -= _P*Qk;
+            V %= _N;
+            V1 = square(V1);
+            V1 += _N;
+            V1 -= _negQ ? -2*Qk : 2;
+            V1 %= _N;
+        }
+        else
+        {
+            V1 *= V;
+            V1 += _N;
+            V1 -= _P*Qk;
+            V1 %= _N;
+            V = square(V);
+            V += _N;
+            V -= 2*Qk;
+            V %= _N;
+        }
+        odd = exp.bit(i);
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "arithmetic.h"
+#include "inputnum.h"
+#include "file.h"
+
+#include "prst.h"
+
+class Proof;
+
+// Performs the test selected by Run::create with plain Giant arithmetic, without constructing the GWnum test.
+// For small numbers the setup of a GWnum transform can cost more than the test itself.
+class SmallRun : public Run
+{
+public:
+    // Inputs up to this many bits are tested with GMP, 0 = none.
+    static int MAX_BITLEN;
+    // Tests after Fermat::AUTO, FERMAT, PROTH and POCKLINGTON.
+    static const int POCKLINGTON_GENERIC = 4;
+    static const int MORRISON = 5;
+    static const int MORRISON_GENERIC = 6;
+
+public:
+    SmallRun(int test, InputNum& input, Options& options, Logging& logging);
+    virtual ~SmallRun() { }
+
+    static bool applicable(InputNum& input, Options& options, Proof* proof);
+
+    void run(arithmetic::GWState& gwstate, File& file_checkpoint, File& file_recoverypoint, Logging& logging) override;
+    void run(Logging& logging);
+
+    // Fermat and Proth tests don't restart, their exponentiation can run on any thread.
+    bool lane();
+    void calc();
+    void report(Logging& logging);
+    double time() { return _time; }
+
+protected:
+    void init_fermat(Logging& logging);
+    void init_morrison(Logging& logging);
+    void run_pocklington(Logging& logging, int a, bool generic);
+    void run_morrison(Logging& logging, bool generic);
+    void lucas_V(arithmetic::Giant& exp, arithmetic::Giant& V);
+
+protected:
+    int _test;
+    arithmetic::Giant _N;
+    int _type = 0;
+    int _a = 0;
+    double _time = 0;
+    int _P = 0;
+    bool _negQ = false;
+};
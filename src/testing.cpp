@@ -20,6 +20,7 @@
 #include "proof.h"
 #include "pocklington.h"
 #include "morrison.h"
+#include "small.h"
 #include "testing.h"
 #include "abc_parser.h"
 
@@ -41,6 +42,9 @@ int testing_main(int argc, char *argv[])
         .value_number("-t", ' ', options.thread_count, 1, 256)
         .value_number("-spin", ' ', options.spin_threads, 0, 256)
         .value_enum("-cpu", ' ', options.instructions, Enum<std::string>().add("SSE2", "SSE2").add("AVX", "AVX").add("FMA3", "FMA3").add("AVX512F", "AVX512F"))
+        .value_number("-mem", ' ', MultipointExp::MEMORY_LIMIT, 1, INT_MAX)
+        .value_string("-dac", ' ', DACCache::FILENAME)
+        .value_number("-small", ' ', SmallRun::MAX_BITLEN, 0, INT_MAX)
         .value_number("-fft", '+', options.next_fft_count, 0, 5)
         .group("-fft")
             .value_number("+", 0, options.next_fft_count, 0, 5)
@@ -92,12 +96,14 @@ int testing_main(int argc, char *argv[])
                 subset = param;
             })
         .parse_args(argc, argv);
+    // Only the small subset goes through SmallRun, the rest keep testing GWnum arithmetic.
+    int small_bitlen = SmallRun::MAX_BITLEN > 0 ? SmallRun::MAX_BITLEN : 2048;
 
     if (subset.empty())
     {
         printf("Usage: PRST -test <subset> <options>\n");
         printf("Subsets:\n");
-        printf("\tall = 321plus + 321minus + b5plus + b5minus + gfn13 + special + error + freeform + deterministic + prime\n");
+        printf("\tall = 321plus + 321minus + b5plus + b5minus + gfn13 + special + error + freeform + deterministic + prime + small\n");
         printf("\tslow = gfn13more + 100186b5minus + 109208b5plus\n");
         printf("\tabc_parser\n");
         return PRST_EXIT_NORMAL;
@@ -186,6 +192,39 @@ int testing_main(int argc, char *argv[])
             cont.emplace_back(new Test(*kbncTest));
     }
 
+    if (subset == "all" || subset == "small")
+    {
+        auto& cont = add("small");
+        auto add_small = [&](Test* test) {
+            std::unique_ptr<Test> ptr(test);
+            if (ptr->input_bitlen <= small_bitlen)
+                cont.push_back(std::move(ptr));
+        };
+        for (NTest* nTest = Test321Plus; nTest->n != 0; nTest++)
+            add_small(new SmallTest(3, 2, *nTest, 1));
+        for (NTest* nTest = Test321Minus; nTest->n != 0; nTest++)
+        {
+            add_small(new SmallTest(3, 2, *nTest, -1));
+            add_small(new ParityTest(3, 2, *nTest, -1));
+        }
+        for (NTest* nTest = TestBase5Plus; nTest->n != 0; nTest++)
+        {
+            add_small(new SmallTest(2, 5, *nTest, 1));
+            add_small(new ParityTest(2, 5, *nTest, 1));
+        }
+        for (NTest* nTest = TestBase5Minus; nTest->n != 0; nTest++)
+        {
+            add_small(new SmallTest(2, 5, *nTest, -1));
+            add_small(new ParityTest(2, 5, *nTest, -1));
+        }
+        for (FreeFormTest* ffTest = TestFreeForm; ffTest->s[0] != 0; ffTest++)
+        {
+            add_small(new SmallTest(*ffTest));
+            if (ffTest->res64 == 1)
+                add_small(new DeterministicTest(*ffTest));
+        }
+    }
+
     if (subset == "slow" || subset == "gfn13more")
     {
         auto& cont = add("gfn13more");
@@ -251,6 +290,7 @@ int testing_main(int argc, char *argv[])
         {
             logging.progress().update(0, 0);
             logging.warning("Running %s tests.\n", std::get<0>(subsetTests).data());
+            SmallRun::MAX_BITLEN = std::get<0>(subsetTests) == "small" ? small_bitlen : 0;
             if (std::get<0>(subsetTests) == "error")
             {
                 test_text = "error";
@@ -306,7 +346,7 @@ void Test::run(Logging& logging, Options& options)
     File file_recoverypoint("prst_rcpt", fingerprint);
 
     GWState gwstate;
-    options.configure(gwstate);
+    options.configure(gwstate, input);
     logging.progress().configure(gwstate);
     input.setup(gwstate);
     logging.info("Using %s.\n", gwstate.fft_description.data());
@@ -320,6 +360,7 @@ void Test::run(Logging& logging, Options& options)
         file_checkpoint.clear(true);
         file_recoverypoint.clear(true);
         gwstate.done();
+        DACCache::save();
     };
     try
     {
@@ -405,15 +446,19 @@ void DeterministicTest::run(Logging& logging, Options& options)
     logging.file_progress(&file_progress);
 
     std::unique_ptr<Run> run(Run::create(input, options, logging));
+    SmallRun* small = dynamic_cast<SmallRun*>(run.get());
 
     File file_checkpoint("prst_ckpt", fingerprint);
     File file_recoverypoint("prst_rcpt", fingerprint);
 
     GWState gwstate;
-    options.configure(gwstate);
+    options.configure(gwstate, input);
     logging.progress().configure(gwstate);
-    input.setup(gwstate);
-    logging.info("Using %s.\n", gwstate.fft_description.data());
+    if (small == nullptr)
+    {
+        input.setup(gwstate);
+        logging.info("Using %s.\n", gwstate.fft_description.data());
+    }
 
     auto finally = [&]
     {
@@ -421,10 +466,14 @@ void DeterministicTest::run(Logging& logging, Options& options)
         file_checkpoint.clear(true);
         file_recoverypoint.clear(true);
         gwstate.done();
+        DACCache::save();
     };
     try
     {
-        run->run(gwstate, file_checkpoint, file_recoverypoint, logging);
+        if (small != nullptr)
+            small->run(logging);
+        else
+            run->run(gwstate, file_checkpoint, file_recoverypoint, logging);
         bool prime = run->prime();
         std::string sres64 = run->res64();
         if (res64 == 0)
@@ -448,6 +497,49 @@ void DeterministicTest::run(Logging& logging, Options& options)
     finally();
 }
 
+void SmallTest::run(Logging& logging, Options& options)
+{
+    uint32_t fingerprint = input.fingerprint();
+    File file_progress("prst_param", fingerprint);
+    file_progress.hash = false;
+    logging.file_progress(&file_progress);
+
+    SmallRun run(Fermat::AUTO, input, options, logging);
+    run.run(logging);
+    file_progress.clear(true);
+    if (run.success() != (res64 == 1))
+    {
+        logging.error("Primality mismatch.\n");
+        throw TaskAbortException();
+    }
+    if (!run.success() && std::stoull(run.res64(), nullptr, 16) != res64)
+    {
+        logging.error("RES64 mismatch.\n");
+        throw TaskAbortException();
+    }
+}
+
+void ParityTest::run(Logging& logging, Options& options)
+{
+    int small_bitlen = SmallRun::MAX_BITLEN;
+    // Composite residues in test.data are of the Fermat test with a = 3, as is the first stage of Pocklington tests.
+    // The Lucas residue of a composite comes from the GMP run and the GWnum run has to match it.
+    if (res64 != 1 && input.c() != 1)
+        res64 = 0;
+    try
+    {
+        DeterministicTest::run(logging, options);
+        SmallRun::MAX_BITLEN = 0;
+        DeterministicTest::run(logging, options);
+    }
+    catch (...)
+    {
+        SmallRun::MAX_BITLEN = small_bitlen;
+        throw;
+    }
+    SmallRun::MAX_BITLEN = small_bitlen;
+}
+
 void RootsTest(Logging& logging, Options& options)
 {
     SubLogging noLogging(logging, Logging::LEVEL_ERROR + 1);
@@ -475,7 +567,7 @@ void RootsTest(Logging& logging, Options& options)
     proof_build.init_files(&file_proofpoint, &file_proofproduct, &file_cert);
 
     GWState gwstate;
-    options.configure(gwstate);
+    options.configure(gwstate, input);
     gwstate.maxmulbyconst = fermat.a();
     input.setup(gwstate);
     logging.info("Using %s.\n", gwstate.fft_description.data());
@@ -489,6 +581,7 @@ void RootsTest(Logging& logging, Options& options)
         file_checkpoint.clear(true);
         file_recoverypoint.clear(true);
         gwstate.done();
+        DACCache::save();
     };
 
     std::vector<std::unique_ptr<BaseExp::State>> points;
@@ -637,7 +730,7 @@ void RootsTest(Logging& logging, Options& options)
     proof.init_files(&file_proofpoint, &file_proofproduct, &file_cert);
     proof_build.init_files(&file_proofpoint, &file_proofproduct, &file_cert);
 
-    options.configure(gwstate);
+    options.configure(gwstate, input);
     logging.progress().configure(gwstate);
     input.setup(gwstate);
     logging.info("Using %s.\n", gwstate.fft_description.data());
@@ -705,7 +798,7 @@ void RootsTest(Logging& logging, Options& options)
     proof.init_files(&file_proofpoint, &file_proofproduct, &file_cert);
     proof_build.init_files(&file_proofpoint, &file_proofproduct, &file_cert);
 
-    options.configure(gwstate);
+    options.configure(gwstate, input);
     logging.progress().configure(gwstate);
     input.setup(gwstate);
     logging.info("Using %s.\n", gwstate.fft_description.data());
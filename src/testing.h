@@ -93,6 +93,7 @@ public:
 class DeterministicTest : public Test
 {
 public:
+    DeterministicTest(int k, int b, NTest& t, int c) : Test(k, b, t, c) { }
     DeterministicTest(FreeFormTest& t) : Test(t) { }
     DeterministicTest(KBNCTest& t) : Test(t) { }
 
@@ -116,6 +117,39 @@ public:
     void run(Logging& logging, Options& options) override;
 };
 
+// Runs the deterministic test with GMP and with GWnum arithmetic, the results and residues have to match.
+class ParityTest : public DeterministicTest
+{
+public:
+    ParityTest(int k, int b, NTest& t, int c) : DeterministicTest(k, b, t, c) { }
+
+    std::string display_text() override
+    {
+        std::string text = DeterministicTest::display_text();
+        return text.substr(0, text.size() - 1) + " with GMP and GWnum arithmetic.";
+    }
+
+    void run(Logging& logging, Options& options) override;
+};
+
+class SmallTest : public Test
+{
+public:
+    SmallTest(int k, int b, NTest& t, int c) : Test(k, b, t, c) { }
+    SmallTest(FreeFormTest& t) : Test(t) { }
+
+    std::string display_text() override
+    {
+        if (input.type() == InputNum::ZERO && !input.parse(input_text))
+            throw std::runtime_error("Parse failed.");
+        if (input.type() == InputNum::KBNC && input.c() == 1 && input.b() == 2 && log2(input.gk()) < input.n())
+            return input.display_text() + ", Proth test with GMP arithmetic.";
+        return input.display_text() + ", Fermat test with GMP arithmetic.";
+    }
+
+    void run(Logging& logging, Options& options) override;
+};
+
 class TestLogging : public Logging
 {
 public: